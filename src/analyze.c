@@ -0,0 +1,515 @@
+/* analyze.c --- Analyse hors ligne d'un instantané du tas.  */
+
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * DESCRIPTION
+ *
+ * Reads a snapshot written by gc_snapshot and reports where the memory
+ * goes, to hunt leaks:
+ *      -the objects reachable from the roots, and the unreachable ones
+ *          (garbage waiting for the next collection)
+ *      -the dominator tree: an object dominates another if every path
+ *          from the roots to the other goes through it
+ *      -the retained size of each object: what would be freed with it,
+ *          its size plus the sizes of everything it dominates
+ *      -the roots retaining the most, the objects retaining the most and
+ *          the classes
+ *
+ * The graph gets a virtual node 0 pointing to everything the roots
+ * reference, object i of the snapshot is node i+1.
+ *
+ * The dominators are computed with the iterative algorithm of Cooper,
+ * Harvey and Kennedy ("A Simple, Fast Dominance Algorithm"), over the
+ * reverse postorder of a depth first search from node 0.
+ *
+ * usage: analyze [-n top] [-d] snapshot
+ *      -n: number of roots/objects/classes listed (10)
+ *      -d: also print the dominator tree, one "node idom" per line
+ */
+
+#define UNDEFINED 0xFFFFFFFFu
+
+/*THE WHOLE SNAPSHOT, ADJACENCY IN COMPRESSED ROWS*/
+struct graph
+{
+    uint32_t nodes;             /* objects + 1 */
+    uint64_t heapSize;
+    uint64_t used;
+    uint32_t classes;
+    struct GCsnapClass* classTable;
+    uint64_t* offset;           /* per node */
+    uint64_t* size;
+    uint32_t* classId;
+    uint32_t* first;            /* successors of v: succ[first[v]..first[v+1]] */
+    uint32_t* succ;
+    uint32_t* predFirst;        /* same for the predecessors */
+    uint32_t* pred;
+};
+
+
+/*READ EXACTLY count ITEMS OR DIE*/
+void readOrDie(void* ptr, size_t size, size_t count, FILE* in)
+{
+    if(count > 0 && fread(ptr, size, count, in) != count)
+    {
+        fprintf(stderr, "analyze: truncated snapshot\n");
+        exit(2);
+    }
+}
+
+void* allocOrDie(size_t count, size_t size)
+{
+    void* p = calloc(count ? count : 1, size);
+    if(p == NULL)
+    {
+        fprintf(stderr, "analyze: out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+/*LOAD THE SNAPSHOT IN g*/
+void loadGraph(const char* path, struct graph* g)
+{
+    FILE* in = fopen(path, "rb");
+    if(in == NULL)
+    {
+        perror(path);
+        exit(2);
+    }
+    setvbuf(in, NULL, _IOFBF, 1 << 20);
+
+    struct GCsnapHeader header;
+    readOrDie(&header, sizeof(header), 1, in);
+    if(memcmp(header.magic, GC_SNAP_MAGIC, sizeof(GC_SNAP_MAGIC)) != 0)
+    {
+        fprintf(stderr, "analyze: %s is not a heap snapshot\n", path);
+        exit(2);
+    }
+
+    g->heapSize = header.heapSize;
+    g->used = header.used;
+    g->classes = header.classes;
+    g->nodes = header.objects + 1;
+    g->classTable = (struct GCsnapClass*) allocOrDie(header.classes, sizeof(struct GCsnapClass));
+    readOrDie(g->classTable, sizeof(struct GCsnapClass), header.classes, in);
+
+    g->offset = (uint64_t*) allocOrDie(g->nodes, sizeof(uint64_t));
+    g->size = (uint64_t*) allocOrDie(g->nodes, sizeof(uint64_t));
+    g->classId = (uint32_t*) allocOrDie(g->nodes, sizeof(uint32_t));
+    g->first = (uint32_t*) allocOrDie(g->nodes + 1, sizeof(uint32_t));
+
+    /* the edges of node 0 (the roots) come last in the file, read the
+       objects' edges in a growing array and shift them afterwards */
+    size_t capacity = 1024;
+    size_t edges = 0;
+    uint32_t* succ = (uint32_t*) allocOrDie(capacity, sizeof(uint32_t));
+    uint32_t v = 1;
+    for(; v<(g->nodes); v++)
+    {
+        struct GCsnapObject record;
+        readOrDie(&record, sizeof(record), 1, in);
+        g->offset[v] = record.offset;
+        g->size[v] = record.size;
+        g->classId[v] = record.classId;
+        g->first[v] = (uint32_t) edges;
+        while(edges + record.refs > capacity)
+        {
+            capacity *= 2;
+            succ = (uint32_t*) realloc(succ, capacity * sizeof(uint32_t));
+            if(succ == NULL)
+            {
+                fprintf(stderr, "analyze: out of memory\n");
+                exit(2);
+            }
+        }
+        readOrDie(&succ[edges], sizeof(uint32_t), record.refs, in);
+        edges += record.refs;
+    }
+
+    /* node 0 first, then everything moves by the number of roots */
+    uint32_t roots = header.roots;
+    g->succ = (uint32_t*) allocOrDie(edges + roots, sizeof(uint32_t));
+    readOrDie(g->succ, sizeof(uint32_t), roots, in);
+    memcpy(&(g->succ[roots]), succ, edges * sizeof(uint32_t));
+    free(succ);
+    fclose(in);
+
+    g->first[0] = 0;
+    for(v = 1; v<(g->nodes); v++)
+    {
+        g->first[v] += roots;
+    }
+    g->first[g->nodes] = (uint32_t) (edges + roots);
+
+    /* object indexes to nodes */
+    size_t e = 0;
+    for(; e<edges + roots; e++)
+    {
+        if(g->succ[e] + 1 >= g->nodes)
+        {
+            fprintf(stderr, "analyze: reference to a missing object\n");
+            exit(2);
+        }
+        g->succ[e]++;
+    }
+
+    /* predecessors, by counting */
+    g->predFirst = (uint32_t*) allocOrDie(g->nodes + 1, sizeof(uint32_t));
+    g->pred = (uint32_t*) allocOrDie(edges + roots, sizeof(uint32_t));
+    for(e = 0; e<edges + roots; e++)
+    {
+        g->predFirst[g->succ[e] + 1]++;
+    }
+    for(v = 0; v<(g->nodes); v++)
+    {
+        g->predFirst[v+1] += g->predFirst[v];
+    }
+    uint32_t* fill = (uint32_t*) allocOrDie(g->nodes, sizeof(uint32_t));
+    memcpy(fill, g->predFirst, g->nodes * sizeof(uint32_t));
+    for(v = 0; v<(g->nodes); v++)
+    {
+        uint32_t i = g->first[v];
+        for(; i<g->first[v+1]; i++)
+        {
+            uint32_t w = g->succ[i];
+            g->pred[fill[w]] = v;
+            fill[w]++;
+        }
+    }
+    free(fill);
+}
+
+void freeGraph(struct graph* g)
+{
+    free(g->classTable);
+    free(g->offset);
+    free(g->size);
+    free(g->classId);
+    free(g->first);
+    free(g->succ);
+    free(g->predFirst);
+    free(g->pred);
+}
+
+/*REVERSE POSTORDER FROM NODE 0, RETURNS THE NUMBER OF REACHED NODES
+ * order[i] is the i-th node, rank[v] its position (UNDEFINED if unreached)
+ */
+uint32_t reversePostorder(struct graph* g, uint32_t* order, uint32_t* rank)
+{
+    uint32_t* stack = (uint32_t*) allocOrDie(g->nodes, sizeof(uint32_t));
+    uint32_t* next = (uint32_t*) allocOrDie(g->nodes, sizeof(uint32_t));
+    char* seen = (char*) allocOrDie(g->nodes, 1);
+    uint32_t postorder = 0;
+    uint32_t depth = 0;
+
+    stack[depth++] = 0;
+    seen[0] = 1;
+    next[0] = g->first[0];
+    while(depth > 0)
+    {
+        uint32_t v = stack[depth-1];
+        if(next[v] < g->first[v+1])
+        {
+            uint32_t w = g->succ[next[v]];
+            next[v]++;
+            if(!seen[w])
+            {
+                seen[w] = 1;
+                next[w] = g->first[w];
+                stack[depth++] = w;
+            }
+        }
+        else
+        {
+            /* done with v, it goes in postorder */
+            order[postorder++] = v;
+            depth--;
+        }
+    }
+
+    /* reverse it */
+    uint32_t i = 0;
+    for(; i<postorder/2; i++)
+    {
+        uint32_t t = order[i];
+        order[i] = order[postorder-1-i];
+        order[postorder-1-i] = t;
+    }
+    for(i = 0; i<(g->nodes); i++)
+    {
+        rank[i] = UNDEFINED;
+    }
+    for(i = 0; i<postorder; i++)
+    {
+        rank[order[i]] = i;
+    }
+    free(stack);
+    free(next);
+    free(seen);
+    return postorder;
+}
+
+/*IMMEDIATE DOMINATORS (Cooper, Harvey, Kennedy)*/
+void dominators(struct graph* g, uint32_t* order, uint32_t* rank,
+                uint32_t reached, uint32_t* idom)
+{
+    uint32_t v = 0;
+    for(; v<(g->nodes); v++)
+    {
+        idom[v] = UNDEFINED;
+    }
+    idom[0] = 0;
+
+    int changed = 1;
+    while(changed)
+    {
+        changed = 0;
+        uint32_t i = 1;
+        for(; i<reached; i++)
+        {
+            v = order[i];
+            uint32_t newIdom = UNDEFINED;
+            uint32_t j = g->predFirst[v];
+            for(; j<g->predFirst[v+1]; j++)
+            {
+                uint32_t p = g->pred[j];
+                if(idom[p] == UNDEFINED)
+                {
+                    continue;
+                }
+                if(newIdom == UNDEFINED)
+                {
+                    newIdom = p;
+                    continue;
+                }
+                /* intersect: walk up until both fingers meet */
+                uint32_t a = p;
+                uint32_t b = newIdom;
+                while(a != b)
+                {
+                    while(rank[a] > rank[b])
+                    {
+                        a = idom[a];
+                    }
+                    while(rank[b] > rank[a])
+                    {
+                        b = idom[b];
+                    }
+                }
+                newIdom = a;
+            }
+            if(idom[v] != newIdom)
+            {
+                idom[v] = newIdom;
+                changed = 1;
+            }
+        }
+    }
+}
+
+/*SORT NODES BY DECREASING RETAINED SIZE*/
+uint64_t* sortKey = NULL;
+
+int compareRetained(const void* a, const void* b)
+{
+    uint64_t x = sortKey[*((const uint32_t*) a)];
+    uint64_t y = sortKey[*((const uint32_t*) b)];
+    return (x < y) - (x > y);
+}
+
+void printNode(struct graph* g, uint32_t v, uint64_t* retained)
+{
+    printf("               object %-8u offset %-10llu class %-4u size %-8llu retained %llu\n",
+           v-1, (unsigned long long) g->offset[v], g->classId[v],
+           (unsigned long long) g->size[v], (unsigned long long) retained[v]);
+}
+
+int main(int narg, char **args)
+{
+    int top = 10;
+    int printTree = 0;
+    const char* path = NULL;
+    int i = 1;
+    for(; i<narg; i++)
+    {
+        if(strcmp(args[i], "-n") == 0 && i+1 < narg)
+        {
+            top = atoi(args[++i]);
+        }
+        else if(strcmp(args[i], "-d") == 0)
+        {
+            printTree = 1;
+        }
+        else
+        {
+            path = args[i];
+        }
+    }
+    if(path == NULL)
+    {
+        fprintf(stderr, "usage: %s [-n top] [-d] snapshot\n", args[0]);
+        return 2;
+    }
+
+    struct graph g;
+    memset(&g, 0, sizeof(g));
+    loadGraph(path, &g);
+
+    uint32_t* order = (uint32_t*) allocOrDie(g.nodes, sizeof(uint32_t));
+    uint32_t* rank = (uint32_t*) allocOrDie(g.nodes, sizeof(uint32_t));
+    uint32_t* idom = (uint32_t*) allocOrDie(g.nodes, sizeof(uint32_t));
+    uint64_t* retained = (uint64_t*) allocOrDie(g.nodes, sizeof(uint64_t));
+    uint32_t reached = reversePostorder(&g, order, rank);
+    dominators(&g, order, rank, reached, idom);
+
+    /* children before parents: reverse of the reverse postorder */
+    uint32_t v = 0;
+    for(; v<g.nodes; v++)
+    {
+        retained[v] = g.size[v];
+    }
+    uint32_t k = reached;
+    while(k > 1)
+    {
+        k--;
+        v = order[k];
+        retained[idom[v]] += retained[v];
+    }
+
+    uint64_t unreachableBytes = 0;
+    for(v = 1; v<g.nodes; v++)
+    {
+        if(rank[v] == UNDEFINED)
+        {
+            unreachableBytes += g.size[v];
+        }
+    }
+
+    /* 15 char spacing */
+    printf("\n");
+    printf("SNAPSHOT       heap size        %llu\n", (unsigned long long) g.heapSize);
+    printf("               used memory      %llu\n", (unsigned long long) g.used);
+    printf("               objects          %u\n", g.nodes - 1);
+    printf("               classes          %u\n", g.classes);
+    printf("               reachable        %u (%llu bytes)\n",
+           reached - 1, (unsigned long long) retained[0]);
+    printf("               unreachable      %u (%llu bytes)\n",
+           g.nodes - reached, (unsigned long long) unreachableBytes);
+    printf("\n");
+
+    /* the nodes right under the virtual root are what the roots retain */
+    sortKey = retained;
+    uint32_t* sorted = (uint32_t*) allocOrDie(g.nodes, sizeof(uint32_t));
+    uint32_t count = 0;
+    for(v = 1; v<g.nodes; v++)
+    {
+        if(rank[v] != UNDEFINED && idom[v] == 0)
+        {
+            sorted[count++] = v;
+        }
+    }
+    qsort(sorted, count, sizeof(uint32_t), &compareRetained);
+    printf("TOP ROOTS      %u objects held directly by the roots\n", count);
+    for(k = 0; k<count && (int) k<top; k++)
+    {
+        printNode(&g, sorted[k], retained);
+    }
+    printf("\n");
+
+    count = 0;
+    for(v = 1; v<g.nodes; v++)
+    {
+        if(rank[v] != UNDEFINED)
+        {
+            sorted[count++] = v;
+        }
+    }
+    qsort(sorted, count, sizeof(uint32_t), &compareRetained);
+    printf("TOP OBJECTS    by retained size\n");
+    for(k = 0; k<count && (int) k<top; k++)
+    {
+        printNode(&g, sorted[k], retained);
+    }
+    printf("\n");
+
+    /* per class: count, shallow size, and retained size of the objects not
+       dominated by another object of the same class */
+    uint64_t* classCount = (uint64_t*) allocOrDie(g.classes, sizeof(uint64_t));
+    uint64_t* classBytes = (uint64_t*) allocOrDie(g.classes + 1, sizeof(uint64_t));
+    uint64_t* classRetained = (uint64_t*) allocOrDie(g.classes, sizeof(uint64_t));
+    for(v = 1; v<g.nodes; v++)
+    {
+        uint32_t c = g.classId[v];
+        if(c >= g.classes)
+        {
+            continue;
+        }
+        classCount[c]++;
+        classBytes[c] += g.size[v];
+        if(rank[v] == UNDEFINED)
+        {
+            continue;
+        }
+        uint32_t d = idom[v];
+        while(d != 0 && g.classId[d] != c)
+        {
+            d = idom[d];
+        }
+        if(d == 0)
+        {
+            classRetained[c] += retained[v];
+        }
+    }
+    sortKey = classRetained;
+    for(k = 0; k<g.classes; k++)
+    {
+        sorted[k] = k;
+    }
+    qsort(sorted, g.classes, sizeof(uint32_t), &compareRetained);
+    printf("TOP CLASSES    by retained size\n");
+    for(k = 0; k<g.classes && (int) k<top; k++)
+    {
+        uint32_t c = sorted[k];
+        printf("               class %-4u size %-8llu objects %-8llu bytes %-10llu retained %llu\n",
+               c, (unsigned long long) g.classTable[c].size, (unsigned long long) classCount[c],
+               (unsigned long long) classBytes[c], (unsigned long long) classRetained[c]);
+    }
+    printf("\n");
+
+    if(printTree)
+    {
+        /* node 0 is printed as "root" */
+        printf("DOMINATORS\n");
+        for(v = 1; v<g.nodes; v++)
+        {
+            if(rank[v] == UNDEFINED)
+            {
+                continue;
+            }
+            if(idom[v] == 0)
+            {
+                printf("%u root\n", v-1);
+            }
+            else
+            {
+                printf("%u %u\n", v-1, idom[v]-1);
+            }
+        }
+    }
+
+    free(classCount);
+    free(classBytes);
+    free(classRetained);
+    free(sorted);
+    free(order);
+    free(rank);
+    free(idom);
+    free(retained);
+    freeGraph(&g);
+    return 0;
+}
@@ -0,0 +1,620 @@
+/* bench.c --- Mesures de performance du gestionnaire de mémoire.  */
+
+#include "gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+/*
+ * DESCRIPTION
+ *
+ * Synthetic workloads, each one run alone (the heap is emptied between
+ * them) and reported as one JSON object per line on stdout, so that the
+ * results can be diffed and tracked from one commit to the next.
+ *
+ *      -binary-trees: a long lived tree, and many short lived complete
+ *          trees of growing depth (the benchmarks game classic)
+ *      -list-churn: a FIFO list, new nodes at the tail, old ones dropped
+ *          at the head
+ *      -mixed-sizes: a table of objects of 6 size classes, random slots
+ *          replaced
+ *      -large-live-set: 3/4 of the heap live for the whole run, enough
+ *          short lived garbage to fill the rest 8 times (so about as many
+ *          collections whatever -m), a few live objects replaced
+ *      -random-graph: 3/4 of the heap in nodes linked at random, reached
+ *          from a few roots, so marking walks the heap in no order; the
+ *          rest filled with garbage 8 times
+ *      -fragmentation: small and large objects interleaved, the small ones
+ *          die, so every collection slides the large ones
+ *
+ * Each line has the operations (allocations) per second, the pauses
+ * (p50, p99 and max, from the gc_on_collect records), the total time
+ * spent marking and compacting, the bytes moved by
+ * the compaction and the peak RSS of the process. The peak RSS is for the
+ * whole process, run one workload per process to compare it
+ * (`make bench` does).
+ *
+ * Everything is seeded, two runs do the same allocations.
+ *
+ * The lines also have the backing of the heap and the data TLB misses
+ * (load misses of the process, from perf_event_open; "unavailable" when
+ * the kernel doesn't allow it), to compare huge pages with normal ones
+ * (`make bench-tlb`).
+ *
+ * usage: bench [-q] [-m MiB] [-H none|transparent|explicit] [-p] [workload...]
+ *      -q: quick run (smaller sizes), for smoke tests
+ *      -m: size of the heap
+ *      -H: huge pages for the heap
+ *      -p: prefault the heap
+ */
+
+/* -------------------------BEGIN-OBJECTS--------------------------------- */
+
+/* Binary tree node, list node and blob all look the same */
+struct Node {
+   uint32_t header;
+   struct Node **left;
+   struct Node **right;
+};
+
+void mark_Node(struct GCobject **o)
+{
+    struct Node *n = (struct Node *) (*o);
+    if((n->left) != NULL)
+    {
+        gc_mark((struct GCobject *) (*(n->left)));
+    }
+    if((n->right) != NULL)
+    {
+        gc_mark((struct GCobject *) (*(n->right)));
+    }
+}
+
+struct GCclass class_Node = { sizeof (struct Node), &mark_Node, NULL };
+
+/* Size classes for the blobs, a Node with a payload at the end */
+#define SIZE_CLASSES 6
+struct GCclass class_Blob[SIZE_CLASSES] = {
+   { sizeof (struct Node) + 8, &mark_Node, NULL },
+   { sizeof (struct Node) + 40, &mark_Node, NULL },
+   { sizeof (struct Node) + 104, &mark_Node, NULL },
+   { sizeof (struct Node) + 232, &mark_Node, NULL },
+   { sizeof (struct Node) + 1000, &mark_Node, NULL },
+   { sizeof (struct Node) + 4072, &mark_Node, NULL },
+};
+
+/* Table of handles, lives outside the pool and is used as a root */
+struct Table {
+   uint32_t header;
+   unsigned int size;
+   struct GCobject ***slots;
+};
+
+void mark_Table(struct GCobject **o)
+{
+    struct Table *t = (struct Table *) (*o);
+    unsigned int i = 0;
+    for(; i<(t->size); i++)
+    {
+        if((t->slots[i]) != NULL)
+        {
+            gc_mark(*(t->slots[i]));
+        }
+    }
+}
+
+struct GCclass class_Table = { sizeof (struct Table), &mark_Table, NULL };
+
+/* --------------------------END-OBJECTS---------------------------------- */
+
+
+
+/* --------------------------BEGIN-HARNESS-------------------------------- */
+
+/*SEEDED RANDOM NUMBERS (xorshift64*)*/
+unsigned long long seed = 88172645463325252ULL;
+
+unsigned long long randomNext(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545F4914F6CDD1DULL;
+}
+
+unsigned int randomBelow(unsigned int n)
+{
+    return (unsigned int) ((randomNext() >> 32) % n);
+}
+
+/*PAUSES OF THE CURRENT WORKLOAD*/
+struct pauses
+{
+    unsigned long long* items;
+    unsigned int size;
+    unsigned int capacity;
+    unsigned long long bytesMoved;
+    unsigned long long markTime;
+    unsigned long long compactTime;
+};
+struct pauses PAUSES = {NULL, 0, 0, 0, 0, 0};
+
+void onCollect(const struct GCcollection *c)
+{
+    if(PAUSES.size == PAUSES.capacity)
+    {
+        unsigned int capacity = PAUSES.capacity ? 2*PAUSES.capacity : 256;
+        unsigned long long* items = (unsigned long long*)
+            realloc(PAUSES.items, capacity * sizeof(unsigned long long));
+        if(items == NULL)
+        {
+            return;
+        }
+        PAUSES.items = items;
+        PAUSES.capacity = capacity;
+    }
+    PAUSES.items[PAUSES.size] = (c->pauseTime);
+    PAUSES.size++;
+    PAUSES.bytesMoved += (c->bytesMoved);
+    PAUSES.markTime += (c->markTime);
+    PAUSES.compactTime += (c->compactTime);
+}
+
+int compareULL(const void* a, const void* b)
+{
+    unsigned long long x = *((const unsigned long long*) a);
+    unsigned long long y = *((const unsigned long long*) b);
+    return (x > y) - (x < y);
+}
+
+/*PERCENTILE OF THE SORTED PAUSES (nearest rank)*/
+unsigned long long percentile(unsigned int p)
+{
+    if(PAUSES.size == 0)
+    {
+        return 0;
+    }
+    unsigned int rank = (p * PAUSES.size + 99) / 100;
+    if(rank == 0)
+    {
+        rank = 1;
+    }
+    return PAUSES.items[rank - 1];
+}
+
+/*DATA TLB LOAD MISSES OF THE PROCESS, -1 IF NOT AVAILABLE*/
+int openTlbCounter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB 
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) 
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+double seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+/*ROOTED TABLE OF HANDLES (its header is set by main)*/
+struct Table table = { 0, 0, NULL };
+struct Table* tablePtr = &table;
+struct GCroot tableRoot = { (struct GCobject **) &tablePtr, NULL };
+
+void tableResize(unsigned int size)
+{
+    free(table.slots);
+    table.slots = (struct GCobject ***) calloc(size ? size : 1, sizeof(struct GCobject **));
+    if(table.slots == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(2);
+    }
+    table.size = size;
+}
+
+/*ALLOCATE OR DIE, THE WORKLOADS ARE SIZED TO FIT*/
+struct Node** allocate(struct GCclass* c)
+{
+    struct Node** n = (struct Node**) gc_malloc(c);
+    if(n == NULL)
+    {
+        fprintf(stderr, "bench: heap exhausted\n");
+        exit(2);
+    }
+    (*n)->left = NULL;
+    (*n)->right = NULL;
+    return n;
+}
+
+/* --------------------------END-HARNESS---------------------------------- */
+
+
+
+/* -------------------------BEGIN-WORKLOADS------------------------------- */
+
+int quick = 0;
+
+/*COMPLETE TREE OF THE GIVEN DEPTH, THE CHILDREN ROOTED WHILE BUILDING*/
+struct Node** bottomUpTree(int depth)
+{
+    struct Node** n;
+    if(depth <= 0)
+    {
+        return allocate(&class_Node);
+    }
+    struct Node** left = bottomUpTree(depth - 1);
+    struct GCroot leftRoot = { (struct GCobject **) left, NULL };
+    gc_protect(&leftRoot);
+    struct Node** right = bottomUpTree(depth - 1);
+    struct GCroot rightRoot = { (struct GCobject **) right, NULL };
+    gc_protect(&rightRoot);
+    n = allocate(&class_Node);
+    (*n)->left = left;
+    (*n)->right = right;
+    gc_unprotect(&rightRoot);
+    gc_unprotect(&leftRoot);
+    return n;
+}
+
+int itemCheck(struct Node** n)
+{
+    if(((*n)->left) == NULL)
+    {
+        return 1;
+    }
+    return 1 + itemCheck((*n)->left) + itemCheck((*n)->right);
+}
+
+unsigned long long binaryTrees(void)
+{
+    int maxDepth = quick ? 14 : 16;
+    int minDepth = 4;
+    unsigned long long ops = 0;
+
+    struct Node** longLived = bottomUpTree(maxDepth);
+    struct GCroot longRoot = { (struct GCobject **) longLived, NULL };
+    gc_protect(&longRoot);
+    ops += (2ULL << maxDepth) - 1;
+
+    int depth = minDepth;
+    long check = 0;
+    for(; depth <= maxDepth; depth += 2)
+    {
+        int iterations = 1 << (maxDepth - depth + minDepth);
+        int i = 0;
+        for(; i<iterations; i++)
+        {
+            check += itemCheck(bottomUpTree(depth));
+            ops += (2ULL << depth) - 1;
+        }
+    }
+    check += itemCheck(longLived);
+    gc_unprotect(&longRoot);
+
+    /* the checksum keeps the compiler honest */
+    if(check <= 0)
+    {
+        fprintf(stderr, "bench: bad tree check\n");
+    }
+    return ops;
+}
+
+unsigned long long listChurn(void)
+{
+    unsigned int length = quick ? 10000 : 100000;
+    unsigned long long ops = quick ? 2000000 : 8000000;
+
+    /* head and tail in the table, the list goes from head to tail */
+    tableResize(2);
+    struct Node** head = allocate(&class_Node);
+    table.slots[0] = (struct GCobject **) head;
+    table.slots[1] = (struct GCobject **) head;
+    struct Node** tail = head;
+    unsigned long long i = 1;
+    for(; i<ops; i++)
+    {
+        struct Node** n = allocate(&class_Node);
+        (*tail)->left = n;
+        tail = n;
+        table.slots[1] = (struct GCobject **) tail;
+        if(i >= length)
+        {
+            head = (*head)->left;
+            table.slots[0] = (struct GCobject **) head;
+        }
+    }
+    return ops;
+}
+
+/*SIZE CLASS, MOSTLY SMALL*/
+struct GCclass* randomSize(void)
+{
+    unsigned int r = randomBelow(100);
+    if(r < 40) return &class_Blob[0];
+    if(r < 65) return &class_Blob[1];
+    if(r < 82) return &class_Blob[2];
+    if(r < 93) return &class_Blob[3];
+    if(r < 99) return &class_Blob[4];
+    return &class_Blob[5];
+}
+
+unsigned long long mixedSizes(void)
+{
+    unsigned int slots = quick ? 5000 : 50000;
+    unsigned long long ops = quick ? 400000 : 2000000;
+    tableResize(slots);
+    unsigned long long i = 0;
+    for(; i<ops; i++)
+    {
+        struct Node** n = allocate(randomSize());
+        table.slots[randomBelow(slots)] = (struct GCobject **) n;
+    }
+    return ops;
+}
+
+/* Collections of the large live set, whatever the size of the heap */
+#define LIVE_SET_COLLECTIONS 8
+
+unsigned long long largeLiveSet(void)
+{
+    /* 3/4 of the heap in 256 byte objects */
+    struct GCstats s = gc_stats();
+    unsigned int live = (unsigned int) ((3 * s.free / 4)
+                                        / (class_Blob[3].size));
+    if(quick)
+    {
+        live /= 4;
+    }
+    tableResize(live);
+    unsigned int i = 0;
+    for(; i<live; i++)
+    {
+        table.slots[i] = (struct GCobject **) allocate(&class_Blob[3]);
+    }
+    /* enough garbage to fill what is left that many times */
+    s = gc_stats();
+    unsigned long long ops = 
+        (quick ? 2 : LIVE_SET_COLLECTIONS) * (s.free / (class_Blob[0].size));
+    unsigned long long op = 0;
+    for(; op<ops; op++)
+    {
+        /* garbage */
+        allocate(&class_Blob[0]);
+        if(op % 1000 == 0)
+        {
+            table.slots[randomBelow(live)] = (struct GCobject **) allocate(&class_Blob[3]);
+        }
+    }
+    return ops + live;
+}
+
+/* Roots of the random graph */
+#define GRAPH_ROOTS 16
+
+unsigned long long randomGraph(void)
+{
+    /* 3/4 of the heap in 128 byte nodes, each linked to two random ones */
+    struct GCstats s = gc_stats();
+    unsigned int nodes = (unsigned int) ((3 * s.free / 4)
+                                         / (class_Blob[2].size));
+    if(quick)
+    {
+        nodes /= 4;
+    }
+    tableResize(nodes);
+    unsigned int i = 0;
+    for(; i<nodes; i++)
+    {
+        table.slots[i] = (struct GCobject **) allocate(&class_Blob[2]);
+    }
+    for(i = 0; i<nodes; i++)
+    {
+        struct Node** n = (struct Node**) table.slots[i];
+        (*n)->left = (struct Node**) table.slots[randomBelow(nodes)];
+        (*n)->right = (struct Node**) table.slots[randomBelow(nodes)];
+    }
+    /* only a few roots, marking is a walk through the graph */
+    struct GCobject** roots[GRAPH_ROOTS];
+    memcpy(roots, table.slots, sizeof(roots));
+    tableResize(GRAPH_ROOTS);
+    memcpy(table.slots, roots, sizeof(roots));
+    
+    /* the part not reached is freed by the first collection */
+    s = gc_stats();
+    unsigned long long ops = 
+        (quick ? 2 : LIVE_SET_COLLECTIONS) * (s.free / (class_Blob[0].size));
+    unsigned long long op = 0;
+    for(; op<ops; op++)
+    {
+        allocate(&class_Blob[0]);
+    }
+    return ops + nodes;
+}
+
+unsigned long long fragmentation(void)
+{
+    unsigned int slots = quick ? 2000 : 10000;
+    unsigned long long ops = quick ? 100000 : 500000;
+    tableResize(slots);
+    unsigned long long i = 0;
+    for(; i<ops; i++)
+    {
+        /* a small one that dies right away in front of a large one */
+        allocate(&class_Blob[randomBelow(3)]);
+        table.slots[randomBelow(slots)] = (struct GCobject **) allocate(&class_Blob[4]);
+    }
+    return 2 * ops;
+}
+
+/* --------------------------END-WORKLOADS-------------------------------- */
+
+
+
+struct workload
+{
+    const char* name;
+    unsigned long long (*run)(void);
+};
+
+struct workload WORKLOADS[] = {
+    { "binary-trees", &binaryTrees },
+    { "list-churn", &listChurn },
+    { "mixed-sizes", &mixedSizes },
+    { "large-live-set", &largeLiveSet },
+    { "random-graph", &randomGraph },
+    { "fragmentation", &fragmentation },
+};
+#define WORKLOAD_COUNT ((int) (sizeof(WORKLOADS) / sizeof(WORKLOADS[0])))
+
+const char* HUGE_NAMES[] = { "none", "transparent", "explicit" };
+int hugePages = GC_HUGE_NONE;
+int tlbCounter = -1;
+
+void runWorkload(struct workload* w)
+{
+    PAUSES.size = 0;
+    PAUSES.bytesMoved = 0;
+    PAUSES.markTime = 0;
+    PAUSES.compactTime = 0;
+    tableResize(0);
+
+    if(tlbCounter >= 0)
+    {
+        ioctl(tlbCounter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(tlbCounter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = seconds();
+    unsigned long long ops = (*(w->run))();
+    double elapsed = seconds() - start;
+    char tlbMisses[32] = "\"unavailable\"";
+    if(tlbCounter >= 0)
+    {
+        unsigned long long misses = 0;
+        ioctl(tlbCounter, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(tlbCounter, &misses, sizeof(misses)) == sizeof(misses))
+        {
+            snprintf(tlbMisses, sizeof(tlbMisses), "%llu", misses);
+        }
+    }
+
+    qsort(PAUSES.items, PAUSES.size, sizeof(unsigned long long), &compareULL);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"workload\": \"%s\", \"quick\": %d, \"ops\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"collections\": %u, \"pause_p50_ns\": %llu, "
+           "\"pause_p99_ns\": %llu, \"pause_max_ns\": %llu, \"mark_ns\": %llu, "
+           "\"compact_ns\": %llu, \"bytes_moved\": %llu, "
+           "\"peak_rss_kb\": %ld, \"huge_pages\": \"%s\", \"dtlb_load_misses\": %s}\n",
+           (w->name), quick, ops, elapsed, (double) ops / elapsed, PAUSES.size,
+           percentile(50), percentile(99), percentile(100), PAUSES.markTime,
+           PAUSES.compactTime, PAUSES.bytesMoved,
+           usage.ru_maxrss, HUGE_NAMES[hugePages], tlbMisses);
+    fflush(stdout);
+
+    /* empty the heap for the next one */
+    tableResize(0);
+    garbage_collect();
+}
+
+int main (int narg, char **args)
+{
+    int i = 1;
+    int selected = 0;
+    struct GCconfig config = GC_CONFIG_DEFAULT;
+    for(; i<narg; i++)
+    {
+        if(strcmp(args[i], "-q") == 0)
+        {
+            quick = 1;
+        }
+        else if(strcmp(args[i], "-p") == 0)
+        {
+            config.prefault = 1;
+        }
+        else if(strcmp(args[i], "-m") == 0 && i+1 < narg)
+        {
+            i++;
+            config.heapSize = (size_t) strtoull(args[i], NULL, 10) << 20;
+        }
+        else if(strcmp(args[i], "-H") == 0 && i+1 < narg)
+        {
+            i++;
+            for(config.hugePages = 2; config.hugePages > 0; config.hugePages--)
+            {
+                if(strcmp(args[i], HUGE_NAMES[config.hugePages]) == 0)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    if(!gc_init(&config))
+    {
+        fprintf(stderr, "bench: can't reserve the heap\n");
+        return 2;
+    }
+    hugePages = config.hugePages;
+    tlbCounter = openTlbCounter();
+
+    table.header = gc_header(&class_Table);
+    gc_protect(&tableRoot);
+    gc_on_collect(&onCollect);
+
+    for(i = 1; i<narg; i++)
+    {
+        if(args[i][0] == '-')
+        {
+            /* skip the value of -m and -H */
+            if((strcmp(args[i], "-m") == 0 || strcmp(args[i], "-H") == 0) && i+1 < narg)
+            {
+                i++;
+            }
+            continue;
+        }
+        int w = 0;
+        for(; w<WORKLOAD_COUNT; w++)
+        {
+            if(strcmp(args[i], WORKLOADS[w].name) == 0)
+            {
+                break;
+            }
+        }
+        if(w == WORKLOAD_COUNT)
+        {
+            fprintf(stderr, "bench: unknown workload %s\n", args[i]);
+            return 2;
+        }
+        runWorkload(&WORKLOADS[w]);
+        selected = 1;
+    }
+
+    /* none given, all of them */
+    if(!selected)
+    {
+        for(i = 0; i<WORKLOAD_COUNT; i++)
+        {
+            runWorkload(&WORKLOADS[i]);
+        }
+    }
+
+    gc_on_collect(NULL);
+    gc_unprotect(&tableRoot);
+    return 0;
+}
@@ -1,43 +1,323 @@
 /* gc.c --- Gestionnaire mémoire.  */
 
 #include "gc.h"
+#include "gc_internal.h"
+#include "snapshot.h"
 #include <stdio.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include <stdlib.h>
+#include <setjmp.h>
+#include <time.h>
+#include <string.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/lsan_interface.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define GC_USDT 1
+#endif
+#endif
 #pragma pack(1)
 
-#define HEAPSIZE 33554432
-
 
 #define GC_MALLOC(t, v) struct t *v = (struct t *)gc_malloc(&class_##t)
 #define GC_MARK(o) gc_mark((struct GCobject *)(o))
 #define GC_ROOT(r, p)               \
    struct GCroot r = { (struct GCobject **)&p, NULL };  \
 
+/* the probe, then the event log if it is on (see the tracing section) */
+#ifdef GC_USDT
+#define GC_PROBE(name, arg) DTRACE_PROBE1(gc, name, arg)
+#else
+#define GC_PROBE(name, arg) ((void) 0)
+#endif
+#define GC_TRACE(type, name, arg)                         \
+   do {                                                    \
+      GC_PROBE(name, arg);                                 \
+      if(TRACELOG.events != NULL) traceEvent(type, arg);   \
+   } while(0)
+
+
+/*GLOBAL HEAP, RESERVED BY gc_init*/
+byte* gc_pool = NULL;
+size_t gc_heap_size = HEAPSIZE;
+
+/*GLOBAL TELEMETRY, CURRENT IS THE COLLECTION IN PROGRESS*/
+static struct GCtelemetry TELEMETRY;
+static struct GCcollection CURRENT;
+/* a finalizer can collect, so the ids are given when a collection starts */
+static unsigned long long collectionsStarted = 0;
+/* gc_malloc counts the allocations, defrag the objects it frees */
+static unsigned long long freedObjects = 0;
+static unsigned long long freedBytes = 0;
+/* end of the last collection, or first allocation */
+static unsigned long long lastCollectionEnd = 0;
+static unsigned long long allocatedAtLastCollection = 0;
 
-/*TYPE DECLARATIONS*/
-typedef char byte;
-typedef unsigned int position;
+/*GLOBAL ROOT */
+static struct GCroot rootAnchor = {NULL, NULL};
+static struct GCroot* FIRSTROOT = &rootAnchor;
+static struct GCroot* LASTROOT = &rootAnchor;
 
-/*GLOBAL HEAP*/
-static byte pool[HEAPSIZE]; 
+/*FORWARD FUNCTION DECLARATIONS*/
+static void memMove(byte array[],
+                    size_t init, 
+                    size_t final,
+                    size_t size);
+/* only the verify build poisons */
+static __attribute__((unused)) void memSet(byte array[],
+                                           byte value,
+                                           size_t position,
+                                           size_t size);
+static void clearWeaks(void);
+static void enqueueFinalizer(struct GCobject* o);
+static int markEphemerons(void);
+static void scanStack(void);
+static void drainMarkStack(void);
+static unsigned long long nowNs(void);
+static void sampleAllocation(struct GCobject** handle);
+static void accountSample(void);
+static void sampleSurvived(struct profileSite* site);
+static void sampleFreed(struct profileSite* site, size_t size);
+static void recordEdge(struct GCobject* o);
+static void purgeEphemerons(void);
+static void traceEvent(unsigned int type, size_t arg);
+static void clearEphemerons(void);
+
+/*FORWARD GLOBAL DECLARATIONS*/
+static unsigned long long profileRate;
+static long long bytesUntilSample;
+struct traceLog
+{
+    struct GCevent* events;
+    size_t size;
+    size_t head;
+    size_t count;
+};
+static struct traceLog TRACELOG;
+#ifdef GC_VERIFY
+static unsigned long stressCount;
+#endif
 
-/*GLOBAL INDEX OF FREE POSITION*/
-unsigned int freep = 0;
 
-/*GLOBAL ROOT */
-struct GCroot rootAnchor = {NULL, NULL};
-struct GCroot* FIRSTROOT = &rootAnchor;
-struct GCroot* LASTROOT = &rootAnchor;
+/* ------------------------BEGIN-HEAP-BACKING----------------------------- 
+ * DESCRIPTION
+ * 
+ * The heap is one anonymous mapping, reserved by gc_init (called with the
+ * defaults by the first allocation). Marking and compaction sweep over
+ * all of it, so it can be backed by huge pages to spare the TLB:
+ *      -transparent: the mapping is aligned on 2 MiB and madvise'd, the
+ *          kernel uses huge pages when it has them
+ *      -explicit: MAP_HUGETLB, from the pages reserved by the system
+ *          (vm.nr_hugepages); without them, falls back to transparent
+ * 
+ * It can also be bound to a NUMA node (mbind, called through syscall so
+ * that libnuma isn't needed) before anything is touched, and prefaulted,
+ * so that the page faults happen in gc_init instead of in gc_malloc.
+ * 
+ * The collector is single threaded, so there is one heap on one node.
+ */
+
+#define HUGE_PAGE ((size_t) 2 << 20)
+#define SMALL_PAGE ((size_t) 4096)
+/* from <numaif.h> */
+#define NUMA_MPOL_BIND 2
+#define NUMA_MAX_NODES 1024
+
+/*MAP size BYTES ALIGNED ON align, NULL IF IT FAILS*/
+static byte* mapAligned(size_t size, size_t align, int flags)
+{
+    /* whole pages, or the tail given back wouldn't start on a page */
+    size = (size + SMALL_PAGE - 1) & ~(SMALL_PAGE - 1);
+    byte* m = (byte*) mmap(NULL, size + align, PROT_READ | PROT_WRITE, 
+                           MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if(m == (byte*) MAP_FAILED)
+    {
+        return NULL;
+    }
+    /* give back what sticks out on both sides */
+    uintptr_t start = ((uintptr_t) m + align - 1) & ~((uintptr_t) align - 1);
+    size_t head = start - (uintptr_t) m;
+    if(head > 0)
+    {
+        munmap(m, head);
+    }
+    if(align - head > 0)
+    {
+        munmap((byte*) start + size, align - head);
+    }
+    return (byte*) start;
+}
+
+/*BIND THE HEAP TO A NODE*/
+static int bindNode(byte* heap, size_t size, int node)
+{
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+    if(node < 0 || node >= NUMA_MAX_NODES)
+    {
+        return 0;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, heap, size, NUMA_MPOL_BIND, mask, 
+                   (unsigned long) NUMA_MAX_NODES, 0) == 0;
+}
+
+int gc_init (struct GCconfig *config)
+{
+    struct GCconfig defaults = GC_CONFIG_DEFAULT;
+    if(config == NULL)
+    {
+        config = &defaults;
+    }
+    if(gc_pool != NULL)
+    {
+        return 0;
+    }
+    size_t size = (config->heapSize) ? (config->heapSize) : HEAPSIZE;
+    
+    byte* heap = NULL;
+    size_t mapped = size;
+    int huge = (config->hugePages);
+    if(huge == GC_HUGE_EXPLICIT)
+    {
+        /* the length is a multiple of the huge page size */
+        mapped = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        heap = (byte*) mmap(NULL, mapped, PROT_READ | PROT_WRITE, 
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(heap == (byte*) MAP_FAILED)
+        {
+            heap = NULL;
+            mapped = size;
+            huge = GC_HUGE_TRANSPARENT;
+        }
+    }
+    if(heap == NULL)
+    {
+        /* only the pages touched are taken, unless prefaulted */
+        int flags = (config->prefault) ? 0 : MAP_NORESERVE;
+        if(huge == GC_HUGE_TRANSPARENT)
+        {
+            heap = mapAligned(size, HUGE_PAGE, flags);
+            if(heap != NULL && madvise(heap, size, MADV_HUGEPAGE) != 0)
+            {
+                huge = GC_HUGE_NONE;
+            }
+        }
+        else
+        {
+            huge = GC_HUGE_NONE;
+            heap = mapAligned(size, SMALL_PAGE, flags);
+        }
+    }
+    if(heap == NULL)
+    {
+        return 0;
+    }
+    
+    if((config->numaNode) >= 0 && !bindNode(heap, size, (config->numaNode)))
+    {
+        munmap(heap, mapped);
+        return 0;
+    }
+    if(config->prefault)
+    {
+        size_t i = 0;
+        for(; i<size; i += SMALL_PAGE)
+        {
+            ((volatile byte*) heap)[i] = 0;
+        }
+    }
+#ifdef __SANITIZE_ADDRESS__
+    /* the objects hold pointers to malloc'ed memory too */
+    __lsan_register_root_region(heap, size);
+#endif
+    
+    (config->hugePages) = huge;
+    gc_pool = heap;
+    gc_heap_size = size;
+    (gc_allocator.base) = gc_pool;
+#ifdef GC_VERIFY
+    const char* every = getenv("GC_VERIFY_EVERY");
+    if(every != NULL)
+    {
+        gc_stress_every = strtoul(every, NULL, 10);
+    }
+#endif
+    gc_set_limit();
+    GC_TRACE(GC_EVENT_HEAP_GROW, heap__grow, size);
+    return 1;
+}
+
+/* ------------------------END-HEAP-BACKING------------------------------- */
+
+
+
+/* ------------------------BEGIN-CLASS-REGISTRY--------------------------- 
+ * DESCRIPTION
+ * 
+ * An object starts with a 32 bit header instead of a pointer to its class:
+ * 
+ *      | class number (24 bits)             | GC bits (8 bits) |
+ * 
+ * The class number indexes gc_classes, the GC bits hold the mark (GC_MARKED)
+ * and the pin (GC_PINNED) that used to be a byte at the end of the object.
+ * So an object takes exactly its size in the pool, and marking it only
+ * touches its first bytes, which are also the ones its mark method reads.
+ * The forwarding address of a moved object doesn't need a place in the
+ * header, it is its handle (the obj field of its page).
+ * 
+ * A class gets its number the first time it is allocated (gc_malloc sees
+ * id == 0 and takes the slow path) or given to gc_header, and keeps it
+ * forever. Number 0 is never given, it stands for no class.
+ */
+
+/*GLOBAL REGISTRY*/
+struct GCclass** gc_classes = NULL;
+static uint32_t classCount = 0;
+static uint32_t classCapacity = 0;
+
+uint32_t gc_header (struct GCclass *c)
+{
+    if((c->id) != 0)
+    {
+        return (c->id) << GC_CLASS_SHIFT;
+    }
+    if((c->size) < sizeof(struct GCobject) || classCount >= GC_MAX_CLASSES)
+    {
+        return 0;
+    }
+    /* room for the new one, 0 included */
+    if(classCount + 1 >= classCapacity)
+    {
+        uint32_t capacity = classCapacity ? 2*classCapacity : 64;
+        struct GCclass** classes = (struct GCclass**) 
+            realloc(gc_classes, capacity * sizeof(struct GCclass*));
+        if(classes == NULL)
+        {
+            return 0;
+        }
+        gc_classes = classes;
+        classCapacity = capacity;
+        gc_classes[0] = NULL;
+    }
+    classCount++;
+    gc_classes[classCount] = c;
+    (c->id) = classCount;
+    return (c->id) << GC_CLASS_SHIFT;
+}
+
+/* ------------------------END-CLASS-REGISTRY----------------------------- */
 
-/*FORWARD FUNCTION DECLARATIONS*/
-void memMove(byte array[],
-             unsigned int init, 
-             unsigned int final,
-             unsigned int size);
 
 
 /*--------------------------BEGIN-PAGE-SYSTEM-----------------------------
@@ -45,24 +325,34 @@ void memMove(byte array[],
  * 
  * This is the page system. It's somewhat a virtual memory system.
  * 
- * It has a linked list of pages, all ordered by allocation (we always
- * allocate at the end, O(1) since we keep a reference to the last page
- * in memory).
+ * It has an array of pages (PAGES), all ordered by allocation (we always
+ * allocate at the end, O(1) since we keep the count), which is also the
+ * order of the positions in the pool. The array is contiguous, so defrag
+ * walks it without chasing pointers, and prefetches the pages and the
+ * objects a few steps ahead.
  * 
- * It has globally accessible first element and uses NULL as sentinel.
+ * The pages are taken by slabs of PAGE_SLAB from one region, reserved at
+ * the first allocation, and go back on a free list when their object dies;
+ * a page never moves, since its obj field is the handle given to the
+ * program. As all the handles are in the region, a handle also fits in 32
+ * bits as an offset in it (GCref, gc_compress in gc.h). The common case of
+ * gc_malloc is inlined from gc.h: take a free page, bump freep, fill the
+ * page. It only comes here (gc_malloc_slow) when the free list is empty or
+ * freep would pass gc_allocator.limit, which is the end of the heap or,
+ * when the profiler runs, the position of the next sample.
  * 
- * Each page has a last byte (the right) which is allocated to
- * represent the mark bit (byte in our case). Since a mark byte is added, 
- * we don't really give a damn about the size and don't require it to be a
- * multiple of 2...
+ * The mark of an object is in its header (see the class registry), so a
+ * page is just the position and the size of the object, and the objects
+ * lie end to end in the pool. We don't really give a damn about the size
+ * and don't require it to be a multiple of 2...
  * 
- * If during garbage collection, the last byte of the page isn't marked, the
+ * If during garbage collection, the object of the page isn't marked, the
  * page is destroyed and the next slides left on last known free position.
  *
  * 
  * Operations complexity (only the ones used in here) 
- * ADD -> O(1), we keep a pointer to the last page
- * DEFRAG -> O(n), this is a combination of walking through the list and
+ * ADD -> O(1), we keep the number of pages
+ * DEFRAG -> O(n), this is a combination of walking through the array and
  * moving the memory left with memMove (which allows overlay of structures).
  * 
  * DEFRAG is called  in the special case that the memory left on the right
@@ -71,8 +361,7 @@ void memMove(byte array[],
  * Although this system doesn't have suitable alignment, from a 
  * practical standpoint it has the advantage of no fragmentation (we can 
  * fill the block completely and it is guaranteed to provide almost as much 
- * space as advertised (we add 1 mark byte per object, so the more objects, 
- * the more marks...).
+ * space as advertised (the only cost per object is its 4 byte header).
  * 
  * This system will be inefficient when a large quantity of small objects 
  * are used because we keep unique page for each object.
@@ -80,8 +369,8 @@ void memMove(byte array[],
  * COMPOSITION
  * The system is composed of the following functions:
  * high level
- *      -addPage(size): adds new memory location
- *      -defrag(): goes through the pages and, delete unmarked ones, 
+ *      -gc_add_page(size): adds new memory location (gc_malloc inlines it)
+ *      -gc_defrag(): goes through the pages and, delete unmarked ones, 
  *          and does the defragmentation.
  * 
  * mid level
@@ -93,36 +382,48 @@ void memMove(byte array[],
  *      -memSet(Left, Size, Char) : like memset but on byte array
  */
 
-struct page 
-{
-    unsigned int left;
-    unsigned int right;
-    unsigned int size;
-    struct GCobject * obj;
-    struct page* next;
-};
-typedef struct page page;
+/* struct page is in gc_internal.h */
+
+/*ALLOCATOR STATE, SHARED WITH gc_malloc IN gc.h
+ * limit starts at 0 so that the first allocation goes through the slow
+ * path
+ */
+struct GCallocator gc_allocator = {NULL, 0, 0, NULL, NULL, NULL, 0, 0, 0};
 
+/*HOW FAR AHEAD gc_defrag PREFETCHES THE PAGES, THEN THEIR OBJECTS*/
+#define PREFETCH_PAGES 16
+#define PREFETCH_OBJECTS 8
 
-page ANCHOR = {0, 0, 0, NULL ,NULL};
-page* FIRSTPAGE = &ANCHOR;
-page* LASTPAGE =  &ANCHOR;
+/*END OF THE FAST REGION WHEN IT WAS LAST SET, FOR THE PROFILER*/
+static position limitBase = 0;
+
+/*PAGE REGION, pagesTop IS THE FIRST PAGE NEVER HANDED OUT*/
+static page* pagesTop = NULL;
+static page* pagesEnd = NULL;
 
 
 
 /*SHIFT PAGE LEFT IN MEMORY*/
-void MV(unsigned int newLeftPosition, 
+static void MV(position newLeftPosition, 
                page* PAGE, byte pool[])
 {
     /*only shift left, since we defrag*/
     assert (newLeftPosition < (PAGE->left));
     
-    unsigned int oldPosition = (PAGE->left);
-    int offset = (PAGE->left) - newLeftPosition;
+    position oldPosition = (PAGE->left);
     (PAGE->left) = newLeftPosition;
-    (PAGE->right) -= offset;
     (PAGE->obj) = (struct GCobject *) &(pool[(PAGE->left)]);
     memMove(pool, oldPosition, newLeftPosition,(PAGE->size));
+    CURRENT.bytesMoved += (PAGE->size);
+#ifdef GC_VERIFY
+    /* what the object left behind, past its new end */
+    position vacated = newLeftPosition + (PAGE->size);
+    if(vacated < oldPosition)
+    {
+        vacated = oldPosition;
+    }
+    memSet(pool, GC_POISON, vacated, oldPosition + (PAGE->size) - vacated);
+#endif
     
 }
 
@@ -130,143 +431,273 @@ void MV(unsigned int newLeftPosition,
  * meaningful only after defrag, otherwise
  * dead objects are conserved 
  */
-unsigned int AVAILABLEMEM()
+static size_t AVAILABLEMEM()
+{
+    return(gc_heap_size - freep);
+}
+
+
+/*GET A SLAB OF FREE PAGES
+ * the region is only reserved, the kernel provides the memory as the
+ * pages get used; the free list keeps the pages that were given back.
+ * PAGES has room for every page of the region.
+ */
+static int refillPages(void)
 {
-    return(HEAPSIZE - freep);
+    if((gc_allocator.pages) == NULL)
+    {
+        void* region = mmap(NULL, PAGE_REGION * sizeof(page), 
+                            PROT_READ | PROT_WRITE, 
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                            -1, 0);
+        if(region == MAP_FAILED)
+        {
+            return 0;
+        }
+        void* order = mmap(NULL, PAGE_REGION * sizeof(page*), 
+                           PROT_READ | PROT_WRITE, 
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+                           -1, 0);
+        if(order == MAP_FAILED)
+        {
+            munmap(region, PAGE_REGION * sizeof(page));
+            return 0;
+        }
+        PAGES = (page**) order;
+        (gc_allocator.pages) = (char*) region;
+        pagesTop = (page*) region;
+        pagesEnd = pagesTop + PAGE_REGION;
+    }
+    size_t count = pagesEnd - pagesTop;
+    if(count == 0)
+    {
+        return 0;
+    }
+    if(count > PAGE_SLAB)
+    {
+        count = PAGE_SLAB;
+    }
+    page* slab = pagesTop;
+    pagesTop += count;
+    GC_TRACE(GC_EVENT_HEAP_GROW, heap__grow, count * sizeof(page));
+    size_t i = 0;
+    for(; i<count-1; i++)
+    {
+        (slab[i].next) = &slab[i+1];
+    }
+    (slab[count-1].next) = (gc_allocator.nodes);
+    (gc_allocator.nodes) = slab;
+    return 1;
+}
+
+/*GIVE A PAGE BACK
+ * obj is cleared, it tells the free pages from the others
+ */
+static void freePage(page* p)
+{
+    (p->obj) = NULL;
+    (p->next) = (gc_allocator.nodes);
+    (gc_allocator.nodes) = p;
 }
 
+/*SET THE END OF THE FAST REGION
+ * the end of the heap, or just before the next sample is due
+ */
+void gc_set_limit(void)
+{
+    limitBase = freep;
+    (gc_allocator.limit) = gc_heap_size;
+#ifdef GC_VERIFY
+    /* every allocation is counted by the slow path */
+    if(gc_stress_every != 0)
+    {
+        (gc_allocator.limit) = freep;
+    }
+#endif
+    if(profileRate != 0)
+    {
+        if(bytesUntilSample <= 1)
+        {
+            (gc_allocator.limit) = freep;
+        }
+        else if((unsigned long long) bytesUntilSample - 1 
+                < gc_heap_size - freep)
+        {
+            (gc_allocator.limit) = freep + (size_t) (bytesUntilSample - 1);
+        }
+    }
+}
 
 /*ADD PAGE TO PAGE SYSTEM
  * by definition, it is added at the end, so it becomes the lastpage
+ * the caller makes sure that there is enough memory, NULL if there are
+ * no pages left
  */
-struct GCobject** addPage(struct GCclass* class)
+struct GCobject** gc_add_page(struct GCclass* class)
 {
-    int size = (class->size);
+    size_t size = (class->size);
+    uint32_t header = gc_header(class);
     
-    /* allocate a new page */
-    page* newPage = (page*) malloc(sizeof(page));
+    /* take a free page */
+    if(header == 0 || (gc_pool == NULL && !gc_init(NULL)))
+    {
+        return NULL;
+    }
+    if((gc_allocator.nodes) == NULL && !refillPages())
+    {
+        return NULL;
+    }
+    page* newPage = (gc_allocator.nodes);
+    (gc_allocator.nodes) = (newPage->next);
     
-    /* the location will be at the end of the system 
-       and we allocate +1 for the markbyte */
+    /* the location will be at the end of the system, unmarked */
     (newPage->left) = freep;
-    (newPage->right) = (freep+size+1);
-    (newPage->size) = (size+1);
-    (newPage->next) = NULL;
-    (newPage->obj) = (struct GCobject*) &pool[freep];
-    (newPage->obj->class) = class;
+    (newPage->size) = size;
+    (newPage->sample) = NULL;
+    (newPage->obj) = (struct GCobject*) &gc_pool[freep];
+    (newPage->obj->header) = header;
     /*(int*) &array[position];*/
-    /* update the LASTPAGE */
-    (LASTPAGE->next) = newPage;
-    LASTPAGE = newPage;
-    freep = (newPage->right)+1;
-    pool[(newPage->left) + (newPage->size)] = 'U';
+    /* it is the last page */
+    PAGES[PAGECOUNT] = newPage;
+    PAGECOUNT++;
+    freep += size;
+    
+    (gc_allocator.allocations)++;
+    (gc_allocator.allocatedBytes) += (newPage->size);
     return &(newPage->obj);
 }
     
 /*DEFRAG*/
-/* to see if the byte is marked we introduce symbols 
- * that are located at the last byte of the structure.
- * They are reached through pointer arithmetic by
- * the page system and the marking system...
- * 'U' -> unmarked
- * 'M' -> marked
- * clustefuck quite possible... careful
- * Also need to call updatePointers after to insure completion
+/* to see if the object is marked we look at the GC bits of its header,
+ * set by the marking system...
+ * none -> unmarked
+ * GC_MARKED -> marked
+ * GC_PINNED -> marked and pinned (conservative pointer to it), can't move
+ * the bits are cleared on the survivors, ready for the next collection
  */
-void defrag()
+void gc_defrag()
 {
-    /* We start at zero and increment */
-    freep = 0;
+    GC_TRACE(GC_EVENT_DEFRAG_BEGIN, defrag__begin, PAGECOUNT);
     
-    /* We ignore the first page, its just there*/
-    page* tmp_before = FIRSTPAGE;
-    page* tmp = (FIRSTPAGE->next);
-    int finished = 0;
+    /* weak references must be cleared while the marks are still there */
+    clearWeaks();
     
-    if(tmp==NULL)
-    {
-        finished = 1;
-    }
+    /* the profiler counts the bytes allocated before freep moves back */
+    accountSample();
+    
+    /* We start at zero and increment */
+    freep = 0;
     
-    while(finished == 0)
+    /* the survivors are packed at the front of PAGES */
+    size_t kept = 0;
+    size_t i = 0;
+    for(; i<PAGECOUNT; i++)
     {
-        /* get the mark byte */
-        int index = (tmp->right);
+        /* the page first, and once it is there, its object */
+        if(i + PREFETCH_PAGES < PAGECOUNT)
+        {
+            __builtin_prefetch(PAGES[i + PREFETCH_PAGES]);
+        }
+        if(i + PREFETCH_OBJECTS < PAGECOUNT)
+        {
+            __builtin_prefetch(&gc_pool[(PAGES[i + PREFETCH_OBJECTS]->left)]);
+        }
+        
+        page* tmp = PAGES[i];
+        
+        /* get the header */
+        uint32_t header = (tmp->obj->header);
+        
+        /* if it is pinned, we unmark it and leave it there */
+        if(header & GC_PINNED)
+        {
+            (tmp->obj->header) = header & ~(GC_MARKED | GC_PINNED);
+            if((tmp->sample) != NULL)
+            {
+                sampleSurvived(tmp->sample);
+            }
+            freep = (tmp->left) + (tmp->size);
+            PAGES[kept] = tmp;
+            kept++;
+        }
         
-        /* if the byte is marked, we unmark it and slide leftmost */
-        if(pool[index] == 'M')
+        /* if it is marked, we unmark it and slide leftmost */
+        else if(header & GC_MARKED)
         {
-            pool[index] ='U';
+            (tmp->obj->header) = header & ~GC_MARKED;
+            if((tmp->sample) != NULL)
+            {
+                sampleSurvived(tmp->sample);
+            }
             if(freep != (tmp->left))
             {
                 
-                MV(freep, tmp, pool);
+                MV(freep, tmp, gc_pool);
             }
-            freep = ((tmp->right)+1);
-            tmp_before = tmp;
-            tmp = tmp->next;
+            freep = (tmp->left) + (tmp->size);
+            PAGES[kept] = tmp;
+            kept++;
         }
         
-        /* if the byte is unmarked, we delete the structure */
-        else if(pool[index] == 'U')
+        /* if it is unmarked, we delete the structure */
+        else
         {
-            /* connect after to before */
-            page* tmp_next = (tmp->next);
-            (tmp_before->next) = tmp_next;
+            /* save a copy for the finalizer before it gets overwritten */
+            if((CLASSOF(tmp->obj)->finalize) != NULL)
+            {
+                enqueueFinalizer(tmp->obj);
+            }
+            
+            freedObjects++;
+            freedBytes += (tmp->size);
+            CURRENT.objectsFreed++;
+            CURRENT.bytesFreed += (tmp->size);
+            if((tmp->sample) != NULL)
+            {
+                sampleFreed(tmp->sample, (tmp->size));
+            }
+            
+#ifdef GC_VERIFY
+            memSet(gc_pool, GC_POISON, (tmp->left), (tmp->size));
+#endif
             
             /* free the node and move on */
-            free(tmp);
-            tmp = tmp_next;
-        }
-        
-        if(tmp == NULL)
-        {
-            finished = 1;
+            freePage(tmp);
         }
     }
+    PAGECOUNT = kept;
     
-    /* reassign LASTPAGE to the last */
-    if(tmp == NULL)
-    {
-        LASTPAGE = tmp_before;
-    }
-    else
+#ifdef GC_VERIFY
+    const char* problem = gc_verify_heap();
+    if(problem != NULL)
     {
-        LASTPAGE = tmp;
+        fprintf(stderr, "gc: heap verification failed: %s\n", problem);
+        abort();
     }
-    
+#endif
+    gc_set_limit();
+    GC_TRACE(GC_EVENT_DEFRAG_END, defrag__end, CURRENT.bytesFreed);
 }
 
 
- /*MEMCPY FOR BYTE ARRAY*/
-void memMove(byte array[],       //array to manipulate
-             unsigned int init,  //initial position
-             unsigned int final, //final position
-             unsigned int size)  //size of the mem chunk
+ /*MEMCPY FOR BYTE ARRAY
+ * (no buffer on the stack, the objects can be larger than the stack)
+ */
+static void memMove(byte array[],       //array to manipulate
+                    size_t init,        //initial position
+                    size_t final,       //final position
+                    size_t size)        //size of the mem chunk
 {
-    byte buffer[size];
-    int i = 0;
-    for(; i<size; i++)
-    {
-        int j = i+init;
-        buffer[i] = array[j];
-        //array[j]='\0';
-    }
-    i=0;
-    for(; i<size; i++)
-    {
-        int j = i+final;
-        array[j] = buffer[i];
-    }
+    memmove(&array[final], &array[init], size);
 }
 
 /*MEMSET FOR BYTE ARRAY*/
-void memSet(byte array[],
-            byte value,
-            unsigned int position,
-            unsigned int size)
+static void memSet(byte array[],
+                   byte value,
+                   size_t position,
+                   size_t size)
 {
-    int i = 0;
+    size_t i = 0;
     for(; i<size; i++)
     {
         array[i+position] = value;
@@ -280,36 +711,29 @@ void memSet(byte array[],
 
 /* -----------------------BEGIN-PRINT-FUNCTIONS---------------------------*/
 /* PRINT A SINGLE MEMORY PAGE */
-void printPage(page* p)
+void gc_print_page(page* p)
 {
-    printf("PAGE           size             %u\n", (p->size));
-    printf("               left position    %u\n", (p->left));
-    printf("               right position   %u\n", (p->right));
-    printf("               array location   %p\n", &pool[(p->left)]);
+    printf("PAGE           size             %zu\n", (p->size));
+    printf("               left position    %zu\n", (p->left));
+    printf("               array location   %p\n", &gc_pool[(p->left)]);
     printf("               pointer location %p\n", (p->obj));
-    printf("               mark byte        %c\n", pool[(p->right)]);
-    if((p->next)==NULL) 
+    printf("               class            %u\n", 
+           (p->obj->header) >> GC_CLASS_SHIFT);
+    printf("               gc bits          %x\n", 
+           (p->obj->header) & ((1u << GC_CLASS_SHIFT) - 1));
+    if(PAGECOUNT > 0 && p == PAGES[PAGECOUNT-1]) 
     {
         printf("               TERMINAL\n");
     }
     printf("\n");
 }
 /* PRINT ALL REACHABLE MEMORY PAGES */
-void printAllPages()
+void gc_print_pages()
 {
-    page* tmp = (FIRSTPAGE->next);
-    int i = 1;
-    while(i==1)
+    size_t i = 0;
+    for(; i<PAGECOUNT; i++)
     {
-        printPage(tmp);
-        if((tmp->next) != NULL)
-        {
-            tmp = (tmp->next);
-        }
-        else
-        {
-            i=0;
-        }
+        gc_print_page(PAGES[i]);
     }
 }
 
@@ -317,579 +741,1923 @@ void printAllPages()
 
 
     
-struct GCobject** gc_malloc (struct GCclass *c)
-{  
-   /* Get the memory size */
-   unsigned int memSize = (unsigned int) (c->size);
-   
-   if(HEAPSIZE<memSize)
-   {
-        printf("NO MEM LEFT, IMMINENT SEGFAULT :)\n");
-        return NULL;
-   }
-   
-   /* on first pass, if there isn't enough mem, we defrag */
-   if (AVAILABLEMEM() < memSize)
-   {
-       garbage_collect();
-   }
-   /* if there still isn't enough memory, we allocate nothing */
-   if (AVAILABLEMEM()< memSize)
-   {
-       printf("NO MEM LEFT, IMMINENT SEGFAULT :)\n");
-       return NULL;
-   }
-   
-   /* if it gets there, we allocate */
-   /* (int*) &array[position]; */
-   return addPage(c);
-}
+/* ------------------------BEGIN-HEAP-PROFILER---------------------------- 
+ * DESCRIPTION
+ * 
+ * Sampling allocation profiler. While it runs, gc_malloc counts down the
+ * bytes until the next sample (the fast path of gc_malloc doesn't count:
+ * gc_set_limit stops it at the sample, and accountSample catches up); the
+ * distance between two samples is drawn from an exponential distribution of
+ * mean profileRate, so every byte has the same chance of being sampled
+ * whatever the size of the objects.
+ * 
+ * A sampled allocation captures its backtrace, which identifies its site
+ * in a hash table of sites, and the page keeps a pointer to the site.
+ * defrag then tells the site when its samples survive a collection or die.
+ * 
+ * gc_profile_dump writes the sites in the legacy "heap profile" text
+ * format of gperftools, which pprof reads (heap_v2 tells pprof the
+ * sampling rate, so it scales the counts back itself).
+ */
 
+/* struct profileSite is in gc_internal.h */
 
+/*GLOBAL PROFILER STATE, profileRate IS 0 WHEN STOPPED*/
+static unsigned long long profileRate = 0;
+static long long bytesUntilSample = 0;
+static unsigned long long profileSeed = 0x2545F4914F6CDD1DULL;
+struct profileSite* gc_sites[PROFILE_BUCKETS];
 
 
-/* --------------------------BEGIN-STATS---------------------------------- */
+/*UNIFORM RANDOM NUMBER IN ]0,1] (xorshift64*)*/
+static double profileRandom(void)
+{
+    profileSeed ^= profileSeed >> 12;
+    profileSeed ^= profileSeed << 25;
+    profileSeed ^= profileSeed >> 27;
+    unsigned long long r = profileSeed * 0x2545F4914F6CDD1DULL;
+    return ((double) ((r >> 11) + 1)) / 9007199254740992.0;
+}
 
-/*RETURNS STATUS OF MEM SYSTEM*/
-struct GCstats gc_stats (void)
+/*NATURAL LOGARITHM OF x IN ]0,1], GOOD TO ~1e-6 (no libm needed)*/
+static double profileLog(double x)
 {
-    /* We proceed through the pages */
-    int count = -1;
-    int usedSize = 0;
-    page* tmp = FIRSTPAGE;
-    int i = 1;
-    while(i==1)
+    /* x = m * 2^e with m in [1,2[ */
+    int e = 0;
+    while(x < 1.0)
     {
-        count++;
-        usedSize += (tmp->size);
-        if((tmp->next)==NULL)
-        {
-            i=0;
-        }
-        else
+        x *= 2.0;
+        e--;
+    }
+    /* ln(m) = 2 atanh((m-1)/(m+1)) */
+    double z = (x - 1.0) / (x + 1.0);
+    double z2 = z*z;
+    double ln = 2.0*z*(1.0 + z2*(1.0/3 + z2*(1.0/5 + z2*(1.0/7 + z2*(1.0/9)))));
+    return ln + e * 0.69314718055994530942;
+}
+
+/*DRAW THE DISTANCE TO THE NEXT SAMPLE*/
+static void nextSample(void)
+{
+    bytesUntilSample = (long long) (-profileLog(profileRandom()) * (double) profileRate) + 1;
+}
+
+/*FIND OR CREATE THE SITE OF A BACKTRACE*/
+static struct profileSite* findSite(void** stack, unsigned int depth)
+{
+    uintptr_t h = depth;
+    unsigned int i = 0;
+    for(; i<depth; i++)
+    {
+        h = (h ^ (uintptr_t) stack[i]) * (uintptr_t) 0x100000001B3ULL;
+    }
+    h %= PROFILE_BUCKETS;
+    
+    struct profileSite* site = gc_sites[h];
+    for(; site != NULL; site = (site->next))
+    {
+        if((site->depth) == depth 
+           && memcmp(site->stack, stack, depth*sizeof(void*)) == 0)
         {
-            tmp = (tmp->next);
+            return site;
         }
     }
     
-    struct GCstats r = {count, usedSize, ((HEAPSIZE) - usedSize)}; 
-    return r;
+    site = (struct profileSite*) calloc(1, sizeof(struct profileSite));
+    if(site == NULL)
+    {
+        return NULL;
+    }
+    (site->depth) = depth;
+    memcpy(site->stack, stack, depth*sizeof(void*));
+    (site->next) = gc_sites[h];
+    gc_sites[h] = site;
+    return site;
 }
 
-/*PRETTY PRINT MEMORY STATUS*/
-void printStats()
+/*RECORD A SAMPLE (noinline, its frame is dropped from the backtrace)*/
+static __attribute__((noinline)) void sampleAllocation(struct GCobject** handle)
 {
-    struct GCstats stats = gc_stats();
-    printf("\n");
-    /* 15 char spacing */
-    printf("HEAP STATUS    objects          %d\n", stats.count);
-    printf("               used memory      %d\n", stats.used);
-    printf("               available memory %d\n", stats.free);
-    printf("\n");
+    nextSample();
+    
+    void* stack[PROFILE_DEPTH + 2];
+    int depth = backtrace(stack, PROFILE_DEPTH + 2);
+    /* drop sampleAllocation and gc_malloc_slow */
+    int skip = (depth > 2) ? 2 : 0;
+    struct profileSite* site = findSite(&stack[skip], (unsigned int) (depth - skip));
+    if(site == NULL)
+    {
+        return;
+    }
     
+    page* p = (page*) ((byte*) handle - offsetof(page, obj));
+    (p->sample) = site;
+    (site->allocCount)++;
+    (site->allocBytes) += (p->size);
+    (site->liveCount)++;
+    (site->liveBytes) += (p->size);
 }
-/* ----------------------------END-STATS---------------------------------- */
-
-
-
-
 
-
-
-/* -----------------------BEGIN-MARKING-FUNCTIONS------------------------- */
-
-
-void gc_mark (struct GCobject* o)
+/*COUNT THE BYTES ALLOCATED BY THE FAST PATH SINCE gc_set_limit*/
+static void accountSample(void)
 {
-    /* get the size of the class */
-    int size = (o->class->size);
-    /* cast to size_t, would also protect against negative integers */
-    size_t size2 = size;
-    /* reach the pointee + 1 byte */
-    byte* b = (byte*) (o);
-    b+=size2;
-    b++;
-    /* mark the byte */
-    (*b) = 'M';
+    if(profileRate != 0)
+    {
+        bytesUntilSample -= (long long) (freep - limitBase);
+    }
+    limitBase = freep;
 }
 
+static void sampleSurvived(struct profileSite* site)
+{
+    (site->survived)++;
+}
 
+static void sampleFreed(struct profileSite* site, size_t size)
+{
+    (site->liveCount)--;
+    (site->liveBytes) -= size;
+}
 
-int rootLen()
+/*FORGET ALL THE SITES AND SAMPLES*/
+void gc_clear_profile(void)
 {
+    size_t p = 0;
+    for(; p<PAGECOUNT; p++)
+    {
+        (PAGES[p]->sample) = NULL;
+    }
     int i = 0;
-    
-    int adequate = 1;
+    for(; i<PROFILE_BUCKETS; i++)
+    {
+        while(gc_sites[i] != NULL)
+        {
+            struct profileSite* next = (gc_sites[i]->next);
+            free(gc_sites[i]);
+            gc_sites[i] = next;
+        }
+    }
+}
+
+void gc_profile_start (size_t rate)
+{
+    gc_clear_profile();
+    profileRate = (rate != 0) ? rate : GC_PROFILE_RATE;
+    nextSample();
+    gc_set_limit();
+}
+
+void gc_profile_stop (void)
+{
+    profileRate = 0;
+    gc_set_limit();
+}
+
+int gc_profile_dump (const char *path)
+{
+    FILE* out = fopen(path, "w");
+    if(out == NULL)
+    {
+        return 0;
+    }
+    
+    /* totals first */
+    unsigned long long liveCount = 0, liveBytes = 0, allocCount = 0, allocBytes = 0;
+    int i = 0;
+    struct profileSite* site;
+    for(; i<PROFILE_BUCKETS; i++)
+    {
+        for(site = gc_sites[i]; site != NULL; site = (site->next))
+        {
+            liveCount += (site->liveCount);
+            liveBytes += (site->liveBytes);
+            allocCount += (site->allocCount);
+            allocBytes += (site->allocBytes);
+        }
+    }
+    unsigned long long rate = (profileRate != 0) ? profileRate : GC_PROFILE_RATE;
+    fprintf(out, "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%llu\n",
+            liveCount, liveBytes, allocCount, allocBytes, rate);
+    
+    for(i = 0; i<PROFILE_BUCKETS; i++)
+    {
+        for(site = gc_sites[i]; site != NULL; site = (site->next))
+        {
+            fprintf(out, "%6llu: %8llu [%6llu: %8llu] @",
+                    (site->liveCount), (site->liveBytes),
+                    (site->allocCount), (site->allocBytes));
+            unsigned int j = 0;
+            for(; j<(site->depth); j++)
+            {
+                fprintf(out, " %p", (site->stack[j]));
+            }
+            fprintf(out, "\n");
+        }
+    }
+    
+    /* pprof needs the mappings to symbolize the addresses */
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps != NULL)
+    {
+        char buffer[4096];
+        size_t n;
+        while((n = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+        {
+            fwrite(buffer, 1, n, out);
+        }
+        fclose(maps);
+    }
+    
+    return (fclose(out) == 0);
+}
+
+static int compareSurvived(const void* a, const void* b)
+{
+    unsigned long long x = (*((struct profileSite* const*) a))->survived;
+    unsigned long long y = (*((struct profileSite* const*) b))->survived;
+    return (x < y) - (x > y);
+}
+
+/*PRETTY PRINT THE SITES WHOSE SAMPLES SURVIVED THE MOST*/
+void gc_print_profile(int top)
+{
+    unsigned int count = 0;
+    int i = 0;
+    struct profileSite* site;
+    for(; i<PROFILE_BUCKETS; i++)
+    {
+        for(site = gc_sites[i]; site != NULL; site = (site->next))
+        {
+            count++;
+        }
+    }
+    struct profileSite** sites = (struct profileSite**) malloc((count + 1) * sizeof(struct profileSite*));
+    if(sites == NULL)
+    {
+        return;
+    }
+    count = 0;
+    for(i = 0; i<PROFILE_BUCKETS; i++)
+    {
+        for(site = gc_sites[i]; site != NULL; site = (site->next))
+        {
+            sites[count] = site;
+            count++;
+        }
+    }
+    qsort(sites, count, sizeof(struct profileSite*), &compareSurvived);
+    
+    printf("\n");
+    /* 15 char spacing */
+    for(i = 0; i<top && i<(int) count; i++)
+    {
+        printf("SITE           survived         %llu\n", (sites[i]->survived));
+        printf("               live samples     %llu\n", (sites[i]->liveCount));
+        printf("               live bytes       %llu\n", (sites[i]->liveBytes));
+        printf("               allocated        %llu\n", (sites[i]->allocCount));
+        printf("               caller           %p\n", (sites[i]->depth) ? (sites[i]->stack[0]) : NULL);
+        printf("\n");
+    }
+    free(sites);
+}
+
+/* ------------------------END-HEAP-PROFILER------------------------------ */
+
+
+
+/* --------------------------BEGIN-LOW-MEMORY----------------------------- 
+ * DESCRIPTION
+ * 
+ * When the slow path of gc_malloc still has no room after a collection
+ * (no bytes left in the pool, or no page left in the region), it doesn't
+ * give up right away:
+ *      -emergency collection: the finalizers waiting in the queue are run
+ *          even if deferred (they may drop roots), the ephemeron tables
+ *          are emptied if the policy says they are caches, and the heap
+ *          is collected again, then once more if finalizers ran
+ *      -the application: the low memory callback is told how many bytes
+ *          are wanted, and can drop its own caches; as long as it says it
+ *          freed something, the heap is collected and checked again, up
+ *          to GC_OOM_RETRIES times
+ * Only then gc_malloc returns NULL, and gc_error says why.
+ * 
+ * The path isn't reentrant: a gc_malloc that runs out of memory from a
+ * finalizer or from the callback fails right away.
+ */
+
+/*GLOBAL LOW MEMORY STATE*/
+static int (*lowMemoryCallback) (size_t size) = NULL;
+static int oomPolicy = GC_OOM_DEFAULT;
+static int inLowMemory = 0;
+static int lastError = GC_ERROR_NONE;
+
+void gc_on_low_memory (int (*callback) (size_t size))
+{
+    lowMemoryCallback = callback;
+}
+
+void gc_oom_policy (int flags)
+{
+    oomPolicy = flags;
+}
+
+int gc_error (void)
+{
+    return lastError;
+}
+
+/*IS THERE A PAGE AND memSize BYTES FOR A NEW OBJECT*/
+static int roomFor(size_t memSize)
+{
+    return (AVAILABLEMEM() >= memSize 
+            && ((gc_allocator.nodes) != NULL || refillPages()));
+}
+
+/*EMERGENCY COLLECTION, THEN THE APPLICATION
+ * returns 1 once there is room for memSize bytes
+ */
+static int lowMemory(size_t memSize)
+{
+    if(inLowMemory)
+    {
+        return 0;
+    }
+    inLowMemory = 1;
+    GC_TRACE(GC_EVENT_LOW_MEMORY, low__memory, memSize);
+    
+    int finalized = 0;
+    if(oomPolicy & GC_OOM_FINALIZE)
+    {
+        finalized = gc_run_finalizers();
+    }
+    if(oomPolicy & GC_OOM_CLEAR_EPHEMERONS)
+    {
+        clearEphemerons();
+    }
+    garbage_collect();
+    if(oomPolicy & GC_OOM_FINALIZE)
+    {
+        finalized += gc_run_finalizers();
+        if(finalized > 0)
+        {
+            garbage_collect();
+        }
+    }
+    
+    int tries = 0;
+    int room = roomFor(memSize);
+    while(!room && lowMemoryCallback != NULL && tries < GC_OOM_RETRIES
+          && (*lowMemoryCallback)(memSize))
+    {
+        garbage_collect();
+        room = roomFor(memSize);
+        tries++;
+    }
+    
+    inLowMemory = 0;
+    return room;
+}
+
+/* --------------------------END-LOW-MEMORY------------------------------- */
+
+
+
+/*SLOW PATH OF gc_malloc (gc.h)
+ * the fast region is exhausted: collect if the heap is full, refill the
+ * free pages, register the class, take the sample, and set the next region
+ */
+struct GCobject** gc_malloc_slow (struct GCclass *c)
+{  
+   /* Get the memory size, the header is in it */
+   size_t memSize = (c->size);
+   
+   GC_TRACE(GC_EVENT_ALLOC_SLOW, alloc__slow, memSize);
+   
+   if(gc_pool == NULL && !gc_init(NULL))
+   {
+        lastError = GC_ERROR_NO_HEAP;
+        return NULL;
+   }
+   if(gc_header(c) == 0)
+   {
+        lastError = GC_ERROR_BAD_CLASS;
+        return NULL;
+   }
+   if((c->size) > gc_heap_size)
+   {
+        lastError = GC_ERROR_TOO_LARGE;
+        return NULL;
+   }
+   
+   accountSample();
+   
+#ifdef GC_VERIFY
+   /* stress: a collection every gc_stress_every allocations */
+   if(gc_stress_every != 0)
+   {
+       stressCount++;
+       if(stressCount >= gc_stress_every)
+       {
+           stressCount = 0;
+           garbage_collect();
+       }
+   }
+#endif
+   
+   /* on first pass, if there isn't enough mem, we defrag */
+   if (!roomFor(memSize))
+   {
+       garbage_collect();
+   }
+   /* if there still isn't enough memory, the emergency path, then nothing */
+   if (!roomFor(memSize) && !lowMemory(memSize))
+   {
+       lastError = GC_ERROR_OUT_OF_MEMORY;
+       return NULL;
+   }
+   
+   /* if it gets there, we allocate */
+   /* (int*) &array[position]; */
+   struct GCobject** handle = gc_add_page(c);
+   
+   if(lastCollectionEnd == 0)
+   {
+       lastCollectionEnd = nowNs();
+   }
+   
+   /* one sample every profileRate bytes, on average */
+   if(profileRate != 0)
+   {
+       bytesUntilSample -= (long long) memSize;
+       if(bytesUntilSample <= 0)
+       {
+           sampleAllocation(handle);
+       }
+   }
+   gc_set_limit();
+   return handle;
+}
+
+
+
+
+
+
+/* --------------------------BEGIN-STATS---------------------------------- */
+
+/*BRING THE COUNTERS UP TO DATE
+ * gc_malloc only counts the allocations, defrag the objects freed
+ */
+static void syncTelemetry(void)
+{
+    TELEMETRY.allocations = (gc_allocator.allocations);
+    TELEMETRY.allocatedBytes = (gc_allocator.allocatedBytes);
+    TELEMETRY.objects = (size_t) ((gc_allocator.allocations) - freedObjects);
+    TELEMETRY.used = (size_t) ((gc_allocator.allocatedBytes) - freedBytes);
+    TELEMETRY.free = gc_heap_size - TELEMETRY.used;
+}
+
+/*RETURNS STATUS OF MEM SYSTEM*/
+struct GCstats gc_stats (void)
+{
+    syncTelemetry();
+    struct GCstats r = {TELEMETRY.objects, 
+                        TELEMETRY.used, 
+                        gc_heap_size - TELEMETRY.used}; 
+    return r;
+}
+
+/*PRETTY PRINT MEMORY STATUS*/
+void gc_print_stats()
+{
+    struct GCstats stats = gc_stats();
+    printf("\n");
+    /* 15 char spacing */
+    printf("HEAP STATUS    objects          %zu\n", stats.count);
+    printf("               used memory      %zu\n", stats.used);
+    printf("               available memory %zu\n", stats.free);
+    printf("\n");
+    
+}
+
+/*TELEMETRY OF THE COLLECTIONS*/
+static void (*collectCallback) (const struct GCcollection *c) = NULL;
+
+/*MONOTONIC CLOCK IN NANOSECONDS*/
+static unsigned long long nowNs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return ((unsigned long long) t.tv_sec) * 1000000000ULL 
+        + (unsigned long long) t.tv_nsec;
+}
+
+const struct GCtelemetry *gc_get_telemetry (void)
+{
+    syncTelemetry();
+    return &TELEMETRY;
+}
+
+void gc_on_collect (void (*callback) (const struct GCcollection *c))
+{
+    collectCallback = callback;
+}
+
+/*START RECORDING A COLLECTION*/
+static void beginCollection(void)
+{
+    struct GCcollection empty = {0};
+    CURRENT = empty;
+    CURRENT.id = ++collectionsStarted;
+}
+
+/*STORE THE RECORD AND TELL THE APPLICATION*/
+static void endCollection(unsigned long long begin,
+                          unsigned long long marked,
+                          unsigned long long compacted,
+                          unsigned long long end)
+{
+    CURRENT.markTime = marked - begin;
+    CURRENT.compactTime = compacted - marked;
+    CURRENT.finalizeTime = end - compacted;
+    CURRENT.pauseTime = end - begin;
+    syncTelemetry();
+    CURRENT.liveObjects = TELEMETRY.objects;
+    CURRENT.liveBytes = TELEMETRY.used;
+    
+    /* rate over the time between the collections, the pause included */
+    if(lastCollectionEnd != 0 && begin > lastCollectionEnd)
+    {
+        double seconds = (double) (begin - lastCollectionEnd) / 1e9;
+        CURRENT.allocationRate = 
+            (double) (TELEMETRY.allocatedBytes - allocatedAtLastCollection) / seconds;
+    }
+    lastCollectionEnd = end;
+    allocatedAtLastCollection = TELEMETRY.allocatedBytes;
+    
+    TELEMETRY.collections++;
+    TELEMETRY.totalPause += CURRENT.pauseTime;
+    if(CURRENT.pauseTime > TELEMETRY.maxPause)
+    {
+        TELEMETRY.maxPause = CURRENT.pauseTime;
+    }
+    TELEMETRY.recent[(CURRENT.id - 1) % GC_TELEMETRY_HISTORY] = CURRENT;
+    
+    if(collectCallback != NULL)
+    {
+        (*collectCallback)(&CURRENT);
+    }
+}
+
+/* ----------------------------END-STATS---------------------------------- */
+
+
+
+/* ----------------------------BEGIN-TRACING------------------------------ 
+ * DESCRIPTION
+ * 
+ * The collector marks its phases with GC_TRACE (slow path of gc_malloc,
+ * marking, compaction, memory taken), which does two things:
+ *      -a USDT probe (provider gc), when <sys/sdt.h> is there: a nop in
+ *          the code and a note in the ELF file, that perf or bpftrace turn
+ *          into a breakpoint when they attach to it
+ *      -a record in the event log, when gc_trace_start turned it on
+ * 
+ * The log is a ring of GCevent, the oldest are overwritten once it is
+ * full, gc_trace_read takes them out. Off, it costs a load and a branch,
+ * and none of the events is on the fast path of gc_malloc.
+ */
+
+/*GLOBAL EVENT LOG, events IS NULL WHEN OFF*/
+static struct traceLog TRACELOG = {NULL, 0, 0, 0};
+
+/*APPEND AN EVENT, OVER THE OLDEST ONE IF FULL*/
+static void traceEvent(unsigned int type, size_t arg)
+{
+    struct GCevent* e = 
+        &(TRACELOG.events[((TRACELOG.head) + (TRACELOG.count)) % (TRACELOG.size)]);
+    (e->time) = nowNs();
+    (e->type) = type;
+    (e->pad) = 0;
+    (e->arg) = arg;
+    if((TRACELOG.count) < (TRACELOG.size))
+    {
+        (TRACELOG.count)++;
+    }
+    else
+    {
+        (TRACELOG.head) = ((TRACELOG.head) + 1) % (TRACELOG.size);
+    }
+}
+
+int gc_trace_start (size_t size)
+{
+    if(size == 0)
+    {
+        size = GC_TRACE_SIZE;
+    }
+    struct GCevent* events = (struct GCevent*) malloc(size * sizeof(struct GCevent));
+    if(events == NULL)
+    {
+        return 0;
+    }
+    gc_trace_stop();
+    TRACELOG.events = events;
+    TRACELOG.size = size;
+    return 1;
+}
+
+void gc_trace_stop (void)
+{
+    free(TRACELOG.events);
+    TRACELOG.events = NULL;
+    TRACELOG.size = 0;
+    TRACELOG.head = 0;
+    TRACELOG.count = 0;
+}
+
+size_t gc_trace_read (struct GCevent *events, size_t max)
+{
+    size_t n = 0;
+    for(; n<max && (TRACELOG.count) > 0; n++)
+    {
+        events[n] = TRACELOG.events[TRACELOG.head];
+        (TRACELOG.head) = ((TRACELOG.head) + 1) % (TRACELOG.size);
+        (TRACELOG.count)--;
+    }
+    return n;
+}
+
+/* ----------------------------END-TRACING-------------------------------- */
+
+
+
+
+
+
+
+/* -----------------------BEGIN-MARKING-FUNCTIONS------------------------- */
+
+
+/* MARK STACK
+ * The mark is a bit in the header of the object (GC_MARKED).
+ * gc_mark only marks and pushes, the objects are traced when popped, so
+ * deep structures don't blow the C stack and cycles are marked once.
+ * 
+ * PREFETCH FIFO
+ * The object given to gc_mark is likely not in the cache, and marking it
+ * means reading its header. The mark method of the class already loaded
+ * the handle to find the object, so gc_mark prefetches the object itself,
+ * puts it in a small FIFO, and marks the object that comes out of the
+ * FIFO, which by then has arrived (Boehm; Cher, Hosking and Vijaykumar).
+ * drainMarkStack empties the FIFO once the stack is empty.
+ */
+#define MARK_FIFO 8
+struct markStack
+{
+    struct GCobject** items;
+    size_t size;
+    size_t capacity;
+};
+static struct markStack MARKSTACK = {NULL, 0, 0};
+static struct GCobject* markFifo[MARK_FIFO];
+static unsigned int fifoHead = 0;
+static unsigned int fifoCount = 0;
+/* set by gc_markAll; outside of it, gc_mark marks right away */
+static int marking = 0;
+/* while a snapshot is written, gc_mark records edges instead */
+static int recordingEdges = 0;
+
+/*IS THE OBJECT IN THE POOL (otherwise it has no mark)*/
+static int inPool(struct GCobject* o)
+{
+    byte* b = (byte*) o;
+    return (gc_pool != NULL && b >= gc_pool && b < &gc_pool[gc_heap_size]);
+}
+
+/*IS THE OBJECT MARKED (objects outside the pool always are)*/
+static int isMarked(struct GCobject* o)
+{
+    return (!inPool(o) || ((o->header) & (GC_MARKED | GC_PINNED)) != 0);
+}
+
+/*CALL THE MARK METHOD OF THE CLASS, IF ANY*/
+static void gc_markMethod(struct GCobject ** pointed)
+{
+    struct GCclass* class = CLASSOF(*pointed);
+    if(class != NULL && (class->mark) != NULL)
+    {
+        (*(class->mark))(pointed);
+    }
+}
+
+/*MARK AN OBJECT AND PUSH IT, RIGHT AWAY*/
+static void markObject(struct GCobject* o)
+{
+    if(o == NULL || isMarked(o))
+    {
+        return;
+    }
+    /* mark the header */
+    (o->header) |= GC_MARKED;
+    CURRENT.objectsMarked++;
+    
+    if((MARKSTACK.size) == (MARKSTACK.capacity))
+    {
+        size_t capacity = (MARKSTACK.capacity) ? 2*(MARKSTACK.capacity) : 1024;
+        struct GCobject** items = (struct GCobject**) 
+            realloc(MARKSTACK.items, capacity * sizeof(struct GCobject*));
+        if(items == NULL)
+        {
+            /* no room left to defer it, trace it right away */
+            gc_markMethod(&o);
+            return;
+        }
+        MARKSTACK.items = items;
+        MARKSTACK.capacity = capacity;
+    }
+    MARKSTACK.items[MARKSTACK.size] = o;
+    MARKSTACK.size++;
+}
+
+void gc_mark (struct GCobject* o)
+{
+    if(recordingEdges)
+    {
+        recordEdge(o);
+        return;
+    }
+    if(o == NULL)
+    {
+        return;
+    }
+    if(!marking)
+    {
+        markObject(o);
+        drainMarkStack();
+        return;
+    }
+    __builtin_prefetch(o);
+    if(fifoCount < MARK_FIFO)
+    {
+        markFifo[(fifoHead + fifoCount) % MARK_FIFO] = o;
+        fifoCount++;
+        return;
+    }
+    /* full, the oldest one goes out and o takes its place */
+    struct GCobject* oldest = markFifo[fifoHead];
+    markFifo[fifoHead] = o;
+    fifoHead = (fifoHead + 1) % MARK_FIFO;
+    markObject(oldest);
+}
+
+/*TRACE EVERYTHING ON THE MARK STACK AND IN THE FIFO*/
+static void drainMarkStack(void)
+{
+    while((MARKSTACK.size) > 0 || fifoCount > 0)
+    {
+        if((MARKSTACK.size) > 0)
+        {
+            MARKSTACK.size--;
+            struct GCobject* o = MARKSTACK.items[MARKSTACK.size];
+            gc_markMethod(&o);
+        }
+        else
+        {
+            struct GCobject* o = markFifo[fifoHead];
+            fifoHead = (fifoHead + 1) % MARK_FIFO;
+            fifoCount--;
+            markObject(o);
+        }
+    }
+}
+
+
+
+int gc_root_len()
+{
+    int i = 0;
+    
+    int adequate = 1;
     struct GCroot* tmp = FIRSTROOT;
     
     while(adequate)
     {
-        if((tmp->next) == NULL)
+        if((tmp->next) == NULL)
+        {
+            adequate = 0;
+        }
+        else
+        {
+            i += 1;
+            tmp = (tmp->next);
+        }
+    }
+    return i;
+}
+
+void gc_protect (struct GCroot *r)
+{
+    /* we can always add at the end because its next is NULL*/
+   assert ((r->next) == NULL);
+   assert ((r->ptr) != NULL);
+   (LASTROOT->next) = r;
+   LASTROOT = r;
+}
+
+
+static void gc_markAll(void)
+{
+    GC_TRACE(GC_EVENT_MARK_BEGIN, mark__begin, CURRENT.id);
+    marking = 1;
+    struct GCroot* tmp;
+    int length = gc_root_len();
+    int i = 0;
+    CURRENT.rootsScanned += length;
+    if(length>0)
+    {    
+        tmp = (FIRSTROOT->next);
+        for(; i< length ; i++)
+        {
+            struct GCobject** pointed = (tmp->ptr);
+            assert(pointed != NULL);
+            if((*pointed) != NULL)
+            {
+                /* roots in the pool are marked, the others are only traced */
+                if(inPool(*pointed))
+                {
+                    gc_mark(*pointed);
+                }
+                else
+                {
+                    gc_markMethod((struct GCobject**) pointed);
+                }
+            }
+            tmp = (tmp->next);
+        }
+    }
+    /* in conservative mode, the stack is a root too */
+    scanStack();
+    drainMarkStack();
+    
+    /* values of ephemerons whose key got marked, until nothing changes */
+    while(markEphemerons())
+    {
+        drainMarkStack();
+    }
+    marking = 0;
+    GC_TRACE(GC_EVENT_MARK_END, mark__end, CURRENT.objectsMarked);
+}
+
+
+void gc_unprotect (struct GCroot *r)
+{
+    /* undefined if many roots pointing to the same... we go O(n) 
+     * until we meet the equal */
+    struct GCroot* tmp_before = FIRSTROOT;
+    /* tmp cannot be null... */
+    struct GCroot* tmp = (FIRSTROOT->next);
+    int adequate = 1;
+    while(adequate)
+    {
+        if(tmp == NULL)
+        {
+            /* arrived at the end */
+            adequate = 0;
+        }
+        else if(tmp == r)
+        {
+            /* get the root out of the root system */
+            adequate = 0;
+            /* get next */
+            tmp = (tmp->next);
+            /* assign next to before */
+            (tmp_before->next) = tmp;
+            (r->next) = NULL;
+            /* the last root is gone, before becomes the last */
+            if(LASTROOT == r)
+            {
+                LASTROOT = tmp_before;
+            }
+
+        }
+        else
+        {
+            /* still not there */
+            tmp_before = tmp;
+            tmp = (tmp->next);
+        }
+    }
+}
+
+
+/* -------------------BEGIN-CONSERVATIVE-STACK-SCANNING------------------- 
+ * DESCRIPTION
+ * 
+ * Optional mostly-copying mode (Bartlett). Instead of registering every
+ * local with gc_protect, the stack (and the registers, spilled on it) is
+ * scanned word by word between the current frame and the bottom given to
+ * gc_conservative.
+ * 
+ * A word can be:
+ *      -a handle (the address of the obj field of a page): the object is
+ *          marked, it can still move since the handle follows it.
+ *      -a raw pointer in the pool (a dereferenced handle): the object
+ *          containing it is marked and pinned (GC_PINNED), defrag leaves it
+ *          where it is and compacts everything around it.
+ *      -anything else, ignored.
+ * 
+ * A word in the pool is looked up by a binary search in PAGES, which is
+ * ordered by position. A handle is checked in O(1), since the pages are
+ * all in their region.
+ */
+
+/*BOTTOM OF THE SCANNED STACK, NULL WHEN NOT CONSERVATIVE*/
+static void* stackBottom = NULL;
+
+void gc_conservative (void *bottom)
+{
+    stackBottom = bottom;
+}
+
+/*INDEX OF THE PAGE CONTAINING POSITION, -1 IF NONE*/
+static long pageIndexAt(position position)
+{
+    size_t lo = 0;
+    size_t hi = PAGECOUNT;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi-lo)/2;
+        page* p = PAGES[mid];
+        if(position < (p->left))
+        {
+            hi = mid;
+        }
+        else if(position >= (p->left) + (p->size))
+        {
+            lo = mid+1;
+        }
+        else
+        {
+            return (long) mid;
+        }
+    }
+    return -1;
+}
+
+/*PAGE CONTAINING POSITION, NULL IF NONE*/
+static page* pageAt(position position)
+{
+    long i = pageIndexAt(position);
+    return (i < 0) ? NULL : PAGES[i];
+}
+
+/*PAGE WHOSE HANDLE IS h, NULL IF NONE
+ * the handles are at a fixed offset in the page region, free pages have
+ * no obj
+ */
+static page* pageOfHandle(uintptr_t h)
+{
+    uintptr_t base = (uintptr_t) (gc_allocator.pages) + offsetof(page, obj);
+    if((gc_allocator.pages) == NULL || h < base || h >= (uintptr_t) pagesTop
+       || (h - base) % sizeof(page) != 0)
+    {
+        return NULL;
+    }
+    page* p = (page*) (h - offsetof(page, obj));
+    return ((p->obj) != NULL) ? p : NULL;
+}
+
+/*MARK (AND PIN) WHAT A WORD MAY POINT TO*/
+static void scanWord(uintptr_t w)
+{
+    if(gc_pool != NULL && w >= (uintptr_t) gc_pool 
+       && w < (uintptr_t) &gc_pool[gc_heap_size])
+    {
+        page* p = pageAt((position) (w - (uintptr_t) gc_pool));
+        if(p != NULL && recordingEdges)
+        {
+            recordEdge(p->obj);
+        }
+        else if(p != NULL)
+        {
+            /* marked now, so that the pin isn't taken for a mark */
+            markObject(p->obj);
+            (p->obj->header) |= GC_PINNED;
+            CURRENT.rootsScanned++;
+        }
+    }
+    else
+    {
+        page* p = pageOfHandle(w);
+        if(p != NULL)
+        {
+            gc_mark(p->obj);
+            CURRENT.rootsScanned++;
+        }
+    }
+}
+
+/*SCAN A MEMORY RANGE, ONE ALIGNED WORD AT A TIME
+ * (stack redzones are read on purpose, hide it from the sanitizer)
+ */
+static __attribute__((no_sanitize_address))
+void scanRange(void* from, void* to)
+{
+    uintptr_t lo = (uintptr_t) from;
+    uintptr_t hi = (uintptr_t) to;
+    if(lo > hi)
+    {
+        uintptr_t t = lo;
+        lo = hi;
+        hi = t;
+    }
+    lo = (lo + sizeof(uintptr_t) - 1) & ~((uintptr_t) sizeof(uintptr_t) - 1);
+    for(; lo + sizeof(uintptr_t) <= hi; lo += sizeof(uintptr_t))
+    {
+        scanWord(*((uintptr_t*) lo));
+    }
+}
+
+/*SCAN FROM THIS FRAME TO THE BOTTOM (noinline, so its frame is below)*/
+static __attribute__((noinline)) void scanFrames(void)
+{
+    void* top = __builtin_frame_address(0);
+    scanRange(top, stackBottom);
+}
+
+static void scanStack(void)
+{
+    if(stackBottom == NULL)
+    {
+        return;
+    }
+    /* spill the callee saved registers in this frame */
+    jmp_buf registers;
+    __builtin_unwind_init();
+    setjmp(registers);
+    scanRange(&registers, (byte*) &registers + sizeof(jmp_buf));
+    scanFrames();
+}
+
+/* -------------------END-CONSERVATIVE-STACK-SCANNING--------------------- */
+
+
+
+/* ---------------------BEGIN-FINALIZER-AND-WEAK-SYSTEM------------------- 
+ * DESCRIPTION
+ * 
+ * Weak references are kept in a linked list, just like the roots. They are
+ * cleared at the beginning of defrag, when the marks still tell which
+ * objects survive, and before the dead pages are freed.
+ * 
+ * Finalizers can't run during defrag since the dead object is about to be
+ * overwritten by its live neighbours. Instead, defrag copies each dead
+ * object whose class has a finalizer to the end of a growable buffer. The
+ * copies start with their header, so the buffer can be walked
+ * without any other bookkeeping. The whole batch is run and freed at once,
+ * after defrag (or later, if the application defers them).
+ */
+
+/*GLOBAL WEAK REFERENCES*/
+struct GCweak gc_weak_anchor = {NULL, NULL};
+static struct GCweak* FIRSTWEAK = &gc_weak_anchor;
+
+/*GLOBAL FINALIZATION QUEUE*/
+struct finalizerQueue
+{
+    byte* buffer;
+    size_t used;
+    size_t capacity;
+};
+static struct finalizerQueue FINALIZERS = {NULL, 0, 0};
+static int deferFinalizers = 0;
+static int runningFinalizers = 0;
+
+
+void gc_weak_ref (struct GCweak *w, struct GCobject **o)
+{
+    /* added at the front, order doesn't matter */
+    assert ((w->next) == NULL);
+    (w->ptr) = o;
+    (w->next) = (FIRSTWEAK->next);
+    (FIRSTWEAK->next) = w;
+}
+
+void gc_weak_unref (struct GCweak *w)
+{
+    struct GCweak* tmp_before = FIRSTWEAK;
+    struct GCweak* tmp = (FIRSTWEAK->next);
+    while(tmp != NULL)
+    {
+        if(tmp == w)
+        {
+            (tmp_before->next) = (tmp->next);
+            (w->next) = NULL;
+            return;
+        }
+        tmp_before = tmp;
+        tmp = (tmp->next);
+    }
+}
+
+/*CLEAR THE WEAK REFERENCES TO UNMARKED OBJECTS*/
+static void clearWeaks(void)
+{
+    struct GCweak* tmp = (FIRSTWEAK->next);
+    while(tmp != NULL)
+    {
+        if((tmp->ptr) != NULL && !isMarked(*(tmp->ptr)))
+        {
+            (tmp->ptr) = NULL;
+        }
+        tmp = (tmp->next);
+    }
+    purgeEphemerons();
+}
+
+/*COPY A DEAD OBJECT AT THE END OF THE FINALIZATION QUEUE*/
+static void enqueueFinalizer(struct GCobject* o)
+{
+    size_t size = (CLASSOF(o)->size);
+    if((FINALIZERS.used) + size > (FINALIZERS.capacity))
+    {
+        size_t capacity = (FINALIZERS.capacity) ? (FINALIZERS.capacity) : 4096;
+        while((FINALIZERS.used) + size > capacity)
+        {
+            capacity *= 2;
+        }
+        byte* buffer = (byte*) realloc(FINALIZERS.buffer, capacity);
+        if(buffer == NULL)
+        {
+            /* can't keep it, the finalizer is lost */
+            return;
+        }
+        FINALIZERS.buffer = buffer;
+        FINALIZERS.capacity = capacity;
+    }
+    memcpy(&(FINALIZERS.buffer[FINALIZERS.used]), o, size);
+    FINALIZERS.used += size;
+}
+
+int gc_run_finalizers (void)
+{
+    /* finalizers may allocate and collect, don't run the batch twice */
+    if(runningFinalizers)
+    {
+        return 0;
+    }
+    runningFinalizers = 1;
+    
+    /* take the batch, new dead objects go in a fresh queue */
+    struct finalizerQueue batch = FINALIZERS;
+    FINALIZERS.buffer = NULL;
+    FINALIZERS.used = 0;
+    FINALIZERS.capacity = 0;
+    
+    int count = 0;
+    size_t offset = 0;
+    while(offset < (batch.used))
+    {
+        struct GCobject* copy = (struct GCobject*) &(batch.buffer[offset]);
+        struct GCclass* class = CLASSOF(copy);
+        offset += (class->size);
+        (*(class->finalize))(copy);
+        count++;
+    }
+    free(batch.buffer);
+    
+    runningFinalizers = 0;
+    return count;
+}
+
+void gc_defer_finalizers (int defer)
+{
+    deferFinalizers = defer;
+}
+
+/* ---------------------END-FINALIZER-AND-WEAK-SYSTEM--------------------- */
+
+
+
+/* -------------------------BEGIN-EPHEMERON-TABLES------------------------ 
+ * DESCRIPTION
+ * 
+ * An ephemeron table maps keys to values, the value being kept alive only
+ * as long as its key is reachable from somewhere else.
+ * 
+ * Each table is an open addressing hash table (linear probing, backward
+ * shift deletion) keyed on the handle of the key. The handles are the
+ * page objects, which never move; defrag only moves the objects behind
+ * them, so the table doesn't care about compaction.
+ * 
+ * During gc_markAll, once the roots are traced, markEphemerons marks the
+ * values of the entries whose key is marked. Those values may themselves
+ * reach other keys, so it is repeated until a pass marks nothing new.
+ * 
+ * The entries with a dead key are purged along with the weak references,
+ * before defrag frees their pages (and malloc hands the handle out again),
+ * and the surviving entries are rehashed in a fresh array.
+ */
+
+struct ephemeron
+{
+    struct GCobject** key;
+    struct GCobject** value;
+};
+
+struct GCephemerons
+{
+    struct ephemeron* entries;
+    unsigned int capacity;      /* always a power of 2 */
+    unsigned int count;
+    struct GCephemerons* next;
+};
+
+/*GLOBAL LIST OF TABLES*/
+static struct GCephemerons ephemeronAnchor = {NULL, 0, 0, NULL};
+static struct GCephemerons* FIRSTEPHEMERONS = &ephemeronAnchor;
+
+
+/*BUCKET OF A KEY*/
+static unsigned int ephemeronHash(struct GCephemerons* t, struct GCobject** key)
+{
+    uintptr_t h = ((uintptr_t) key) >> 3;
+    h *= (uintptr_t) 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) (h >> 32) & ((t->capacity) - 1);
+}
+
+/*INSERT WITHOUT GROWING, THE TABLE MUST HAVE A FREE BUCKET*/
+static void ephemeronInsert(struct GCephemerons* t,
+                            struct GCobject** key,
+                            struct GCobject** value)
+{
+    unsigned int i = ephemeronHash(t, key);
+    while((t->entries[i].key) != NULL)
+    {
+        if((t->entries[i].key) == key)
         {
-            adequate = 0;
+            (t->entries[i].value) = value;
+            return;
         }
-        else
+        i = (i+1) & ((t->capacity) - 1);
+    }
+    (t->entries[i].key) = key;
+    (t->entries[i].value) = value;
+    (t->count)++;
+}
+
+/*REHASH IN A NEW ARRAY, DROPPING THE DEAD KEYS IF ASKED*/
+static int ephemeronRehash(struct GCephemerons* t, unsigned int capacity, 
+                           int purge)
+{
+    struct ephemeron* old = (t->entries);
+    unsigned int oldCapacity = (t->capacity);
+    struct ephemeron* entries = (struct ephemeron*) 
+        calloc(capacity, sizeof(struct ephemeron));
+    if(entries == NULL)
+    {
+        return 0;
+    }
+    (t->entries) = entries;
+    (t->capacity) = capacity;
+    (t->count) = 0;
+    
+    unsigned int i = 0;
+    for(; i<oldCapacity; i++)
+    {
+        struct GCobject** key = old[i].key;
+        if(key != NULL && (!purge || isMarked(*key)))
         {
-            i += 1;
-            tmp = (tmp->next);
+            ephemeronInsert(t, key, old[i].value);
         }
     }
-    return i;
+    free(old);
+    return 1;
 }
 
-void gc_protect (struct GCroot *r)
+struct GCephemerons *gc_ephemerons_new (void)
 {
-    /* we can always add at the end because its next is NULL*/
-   assert ((r->next) == NULL);
-   assert ((r->ptr) != NULL);
-   (LASTROOT->next) = r;
-   LASTROOT = r;
+    struct GCephemerons* t = (struct GCephemerons*) malloc(sizeof(struct GCephemerons));
+    if(t == NULL)
+    {
+        return NULL;
+    }
+    (t->capacity) = 16;
+    (t->count) = 0;
+    (t->entries) = (struct ephemeron*) calloc(t->capacity, sizeof(struct ephemeron));
+    if((t->entries) == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+    /* register it, at the front */
+    (t->next) = (FIRSTEPHEMERONS->next);
+    (FIRSTEPHEMERONS->next) = t;
+    return t;
 }
 
-
-void gc_markMethod(struct GCobject ** pointed)
+void gc_ephemerons_free (struct GCephemerons *t)
 {
-    (*((*pointed)->class->mark))(pointed);
+    struct GCephemerons* tmp_before = FIRSTEPHEMERONS;
+    struct GCephemerons* tmp = (FIRSTEPHEMERONS->next);
+    while(tmp != NULL)
+    {
+        if(tmp == t)
+        {
+            (tmp_before->next) = (tmp->next);
+            break;
+        }
+        tmp_before = tmp;
+        tmp = (tmp->next);
+    }
+    free(t->entries);
+    free(t);
 }
 
-
-void gc_markAll(void)
+int gc_ephemerons_put (struct GCephemerons *t,
+                       struct GCobject **key,
+                       struct GCobject **value)
 {
-    struct GCroot* tmp;
-    int length = rootLen();
-    int i = 0;
-    if(length>0)
-    {    
-        tmp = (FIRSTROOT->next);
-        for(; i< length ; i++)
+    assert(key != NULL);
+    /* keep the load under 3/4 */
+    if(4*((t->count)+1) > 3*(t->capacity))
+    {
+        if(!ephemeronRehash(t, 2*(t->capacity), 0))
         {
-            struct GCobject** pointed = (tmp->ptr);
-            assert(pointed != NULL);
-            gc_markMethod((struct GCobject**) pointed);
-            tmp = (tmp->next);
+            return 0;
         }
     }
+    ephemeronInsert(t, key, value);
+    return 1;
 }
 
-
-void gc_unprotect (struct GCroot *r)
+struct GCobject **gc_ephemerons_get (struct GCephemerons *t,
+                                     struct GCobject **key)
 {
-    /* undefined if many roots pointing to the same... we go O(n) 
-     * until we meet the equal */
-    struct GCroot* tmp_before = FIRSTROOT;
-    /* tmp cannot be null... */
-    struct GCroot* tmp = (FIRSTROOT->next);
-    int adequate = 1;
-    while(adequate)
+    unsigned int i = ephemeronHash(t, key);
+    while((t->entries[i].key) != NULL)
     {
-        if(tmp == NULL)
+        if((t->entries[i].key) == key)
         {
-            /* arrived at the end */
-            adequate = 0;
+            return (t->entries[i].value);
         }
-        else if(tmp == r)
-        {
-            /* get the root out of the root system */
-            adequate = 0;
-            /* get next */
-            tmp = (tmp->next);
-            /* assign next to before */
-            (tmp_before->next) = tmp;
+        i = (i+1) & ((t->capacity) - 1);
+    }
+    return NULL;
+}
 
+void gc_ephemerons_remove (struct GCephemerons *t, struct GCobject **key)
+{
+    unsigned int mask = (t->capacity) - 1;
+    unsigned int i = ephemeronHash(t, key);
+    while((t->entries[i].key) != key)
+    {
+        if((t->entries[i].key) == NULL)
+        {
+            return;
         }
-        else
+        i = (i+1) & mask;
+    }
+    
+    /* backward shift: pull back the followers that can take the hole */
+    unsigned int hole = i;
+    unsigned int j = (i+1) & mask;
+    while((t->entries[j].key) != NULL)
+    {
+        unsigned int home = ephemeronHash(t, t->entries[j].key);
+        if(((j - home) & mask) >= ((j - hole) & mask))
         {
-            /* still not there */
-            tmp_before = tmp;
-            tmp = (tmp->next);
+            t->entries[hole] = t->entries[j];
+            hole = j;
         }
+        j = (j+1) & mask;
     }
+    (t->entries[hole].key) = NULL;
+    (t->entries[hole].value) = NULL;
+    (t->count)--;
 }
 
-
-int garbage_collect (void)
+unsigned int gc_ephemerons_count (struct GCephemerons *t)
 {
-   int start = gc_stats().used;
-   gc_markAll();
-   defrag();
-   int end = gc_stats().used;
-   return (start - end);
+    return (t->count);
 }
 
-struct GCclass testStruct1 = {250, NULL};
-struct GCclass testStruct2 = {1000, NULL};
-int testPages(void)
+/*MARK THE VALUES OF THE MARKED KEYS
+ * returns 1 if anything new got marked
+ */
+static int markEphemerons(void)
 {
-    int testPassed = 1;
-
-    addPage(&testStruct1);
-    addPage(&testStruct2);
+    int changed = 0;
+    struct GCephemerons* t = (FIRSTEPHEMERONS->next);
+    while(t != NULL)
+    {
+        unsigned int i = 0;
+        for(; i<(t->capacity); i++)
+        {
+            struct ephemeron* e = &(t->entries[i]);
+            if((e->key) != NULL && (e->value) != NULL 
+               && isMarked(*(e->key)) && !isMarked(*(e->value)))
+            {
+                gc_mark(*(e->value));
+                changed = 1;
+            }
+        }
+        t = (t->next);
+    }
+    return changed;
+}
 
-    pool[251] = 'M';
-    struct GCstats g = gc_stats();
-    
-    if(g.count != 2)
+/*DROP ALL THE ENTRIES, FOR THE LOW MEMORY PATH*/
+static void clearEphemerons(void)
+{
+    struct GCephemerons* t = (FIRSTEPHEMERONS->next);
+    while(t != NULL)
     {
-        testPassed = 0;
+        memset(t->entries, 0, (t->capacity) * sizeof(struct ephemeron));
+        (t->count) = 0;
+        t = (t->next);
     }
-    
-    defrag();
-    
-    g = gc_stats();
-    if(g.count != 1)
+}
+
+/*DROP THE ENTRIES WHOSE KEY IS DEAD*/
+static void purgeEphemerons(void)
+{
+    struct GCephemerons* t = (FIRSTEPHEMERONS->next);
+    while(t != NULL)
     {
-        testPassed = 0;
+        /* shrink while we are at it, keep the load over 1/4 */
+        unsigned int capacity = (t->capacity);
+        while(capacity > 16 && 4*(t->count) < capacity)
+        {
+            capacity /= 2;
+        }
+        if(!ephemeronRehash(t, capacity, 1))
+        {
+            /* no memory for a new array, purge in place */
+            unsigned int i = 0;
+            while(i<(t->capacity))
+            {
+                struct GCobject** key = (t->entries[i].key);
+                if(key != NULL && !isMarked(*key))
+                {
+                    /* the follower shifted in the hole is looked at again */
+                    gc_ephemerons_remove(t, key);
+                }
+                else
+                {
+                    i++;
+                }
+            }
+        }
+        t = (t->next);
     }
-    
-    defrag();
-    
-    return testPassed;
 }
 
+/* -------------------------END-EPHEMERON-TABLES-------------------------- */
 
 
 
-/* Linked list of integers */
-struct ListInt {
-   struct GCclass *class;
-   int n;
-   struct ListInt ** next;
-   
+/* --------------------------BEGIN-HEAP-SNAPSHOT-------------------------- 
+ * DESCRIPTION
+ * 
+ * gc_snapshot streams the heap to a file in the format of snapshot.h,
+ * read by the analyzer (analyze.c) to compute retained sizes.
+ * 
+ * The outgoing references of an object are found by calling the mark
+ * method of its class while recordingEdges is set: gc_mark then appends
+ * the index of the object it is given to the edge buffer instead of
+ * marking it, so the marks are left alone. Indexes are the positions in
+ * PAGES (pages ordered by position).
+ * 
+ * The references of the roots are recorded the same way: a root in the
+ * pool is an edge to itself, one outside is traced through its method.
+ * In conservative mode, the words of the stack that hit an object (as a
+ * handle or a raw pointer) are roots too.
+ * 
+ * An ephemeron keeps its value alive as long as its key, so each entry is
+ * an edge from the key to the value. Between collections, the only keys
+ * marked are the ones outside the pool; their values are roots.
+ */
+
+/*EDGES OF THE OBJECT BEING WRITTEN*/
+struct edgeBuffer
+{
+    uint32_t* items;
+    unsigned int size;
+    unsigned int capacity;
 };
+static struct edgeBuffer EDGES = {NULL, 0, 0};
 
-void mark_ListInt(struct GCobject **o)
+static void recordEdge(struct GCobject* o)
 {
-    /* recursive marking for ListInt
-     * the marking function must only be called from the root, which
-     * is allocated on the stack, not through gc_malloc, otherwise BOOM
-     * We only mark the next object.
-     */
-    struct ListInt ** l = (struct ListInt**) o;
-    
-    if(((*l)->next) != NULL)
+    if(o == NULL || !inPool(o))
+    {
+        return;
+    }
+    long i = pageIndexAt((position) ((byte*) o - gc_pool));
+    if(i < 0)
+    {
+        return;
+    }
+    if((EDGES.size) == (EDGES.capacity))
     {
-        gc_mark((struct GCobject *) (*((*l)->next)));
-        mark_ListInt((struct GCobject**) (*l)->next);
+        unsigned int capacity = (EDGES.capacity) ? 2*(EDGES.capacity) : 256;
+        uint32_t* items = (uint32_t*) realloc(EDGES.items, capacity * sizeof(uint32_t));
+        if(items == NULL)
+        {
+            /* the edge is lost, the snapshot is still readable */
+            return;
+        }
+        EDGES.items = items;
+        EDGES.capacity = capacity;
     }
+    EDGES.items[EDGES.size] = (uint32_t) i;
+    EDGES.size++;
 }
 
-struct GCclass class_ListInt = { sizeof (struct ListInt), NULL };
-
-struct GCclass class_ListInt2 = {sizeof (struct ListInt), &mark_ListInt};
+/*EDGE FROM AN EPHEMERON KEY, BY THE INDEX OF THE KEY*/
+struct ephemeronEdge
+{
+    uint32_t key;
+    struct GCobject* value;
+};
 
-struct ListInt** cons (int car, struct ListInt **cdr)
+static int compareEphemeronEdges(const void* a, const void* b)
 {
-    struct ListInt** l = (struct ListInt**) gc_malloc(&class_ListInt);
-    (*l)->n = car;
-    (*l)->next = cdr;
-    return l;
+    uint32_t x = ((const struct ephemeronEdge*) a)->key;
+    uint32_t y = ((const struct ephemeronEdge*) b)->key;
+    return (x > y) - (x < y);
 }
 
-
-int test_valueAssign(void)
+/*THE EDGES OF THE ENTRIES WHOSE KEY IS IN THE POOL, SORTED BY KEY
+ * returns 0 if there is no memory for them
+ */
+static int ephemeronEdges(struct ephemeronEdge** edges, size_t* count)
 {
-    int testPassed = 1;
-    struct ListInt** g = (struct ListInt**) gc_malloc(&class_ListInt);
-    
-    /* try assigning  */
-    ((*g)->n)= 25;
-    if(((*g)->n) != 25)
+    size_t capacity = 0;
+    struct GCephemerons* t = (FIRSTEPHEMERONS->next);
+    for(; t != NULL; t = (t->next))
     {
-        testPassed = 0;
+        capacity += (t->count);
     }
-    
-    struct GCstats s = gc_stats();
-    
-    /* verify that one object is counted */
-    if(s.count != 1)
+    (*edges) = NULL;
+    (*count) = 0;
+    if(capacity == 0)
     {
-        testPassed = 0;
+        return 1;
     }
-    
-    
-    /* verify that the object is freed */
-    defrag();
-    struct GCstats s2 = gc_stats();
-    if(s2.count != 0 )
+    (*edges) = (struct ephemeronEdge*) 
+        malloc(capacity * sizeof(struct ephemeronEdge));
+    if((*edges) == NULL)
     {
-        testPassed = 0;
+        return 0;
     }
-    
-    
-    return testPassed;
-    
-
-}
-
-
-
-void printArray(int begin, int end)
-{
-    /* low level byte array printing function */
-    if( begin >= 0 && end < HEAPSIZE)
+    for(t = (FIRSTEPHEMERONS->next); t != NULL; t = (t->next))
     {
-        for( ; begin < end; begin ++)
+        unsigned int i = 0;
+        for(; i<(t->capacity); i++)
         {
-            printf("pool[%d] = %c\n",begin, pool[begin]);
+            struct ephemeron* e = &(t->entries[i]);
+            if((e->key) == NULL || (e->value) == NULL || isMarked(*(e->key)))
+            {
+                continue;
+            }
+            long key = pageIndexAt((position) ((byte*) *(e->key) - gc_pool));
+            if(key >= 0)
+            {
+                (*edges)[*count].key = (uint32_t) key;
+                (*edges)[*count].value = *(e->value);
+                (*count)++;
+            }
         }
     }
+    qsort(*edges, *count, sizeof(struct ephemeronEdge), 
+          &compareEphemeronEdges);
+    return 1;
 }
 
-
-int test_defragging(void)
+/*NUMBER OF A CLASS IN THE SNAPSHOT, ADDED IF NEW*/
+static int snapshotClassId(struct GCclass*** classes, unsigned int* count, 
+                           unsigned int* capacity, struct GCclass* c)
 {
-    int testPassed = 1;
-    struct ListInt** g = (struct ListInt**) gc_malloc(&class_ListInt);
-    
-    /* try assigning  */
-    ((*g)->n)= 25;
-    //((*g)->class) = (&class_ListInt);
-    
-    /* check value */
-    if(((*g)->n) != 25)
-    {
-        testPassed = 0;
-    }
-    
-    /* Mark the structure */
-    gc_mark((struct GCobject*)(*g));
-    
-
-    /* Test the defrag function */
-    defrag();
-    
-    struct GCstats s = gc_stats();
-    if(s.count != 1)
+    unsigned int i = 0;
+    for(; i<(*count); i++)
     {
-        testPassed = 0;
+        if((*classes)[i] == c)
+        {
+            return (int) i;
+        }
     }
-    
-    defrag();
-    s = gc_stats();
-    if(s.count != 0)
+    if((*count) == (*capacity))
     {
-        testPassed = 0;
+        unsigned int newCapacity = (*capacity) ? 2*(*capacity) : 16;
+        struct GCclass** items = (struct GCclass**) 
+            realloc(*classes, newCapacity * sizeof(struct GCclass*));
+        if(items == NULL)
+        {
+            return -1;
+        }
+        (*classes) = items;
+        (*capacity) = newCapacity;
     }
-    
-    return testPassed;
+    (*classes)[*count] = c;
+    (*count)++;
+    return (int) (*count) - 1;
 }
 
-int testTranslation(void)
+/*TRACE THE ROOTS INTO THE EDGE BUFFER*/
+static void recordRootEdges(void)
 {
-    /* create 4 objects, mark 2nd and 4th, defrag and query the values */
-    int testPassed = 1;
-    
-    struct ListInt ** l1 = (struct ListInt**) gc_malloc(&class_ListInt);
-    struct ListInt ** l2 = (struct ListInt**) gc_malloc(&class_ListInt);
-    struct ListInt ** l3 = (struct ListInt**) gc_malloc(&class_ListInt);
-    struct ListInt ** l4 = (struct ListInt**) gc_malloc(&class_ListInt);
-    
-    (*l1)->n = 1;
-    (*l2)->n = 2;
-    (*l3)->n = 3;
-    (*l4)->n = 4;
-    
-    gc_mark((struct GCobject *)(*l2));
-    gc_mark((struct GCobject *)(*l4));
-    
-    //printAllPages();
-    defrag();
-    struct GCstats s = gc_stats();
-    if(s.count != 2)
+    struct GCroot* tmp = (FIRSTROOT->next);
+    for(; tmp != NULL; tmp = (tmp->next))
     {
-        testPassed = 0;
+        struct GCobject** pointed = (tmp->ptr);
+        if((*pointed) == NULL)
+        {
+            continue;
+        }
+        if(inPool(*pointed))
+        {
+            recordEdge(*pointed);
+        }
+        else
+        {
+            gc_markMethod(pointed);
+        }
     }
     
-
-    if(((*l2)->n) != 2)
-    {
-        testPassed = 0;
-    }
-    if(((*l4)->n) != 4)
+    /* the values of the live keys, outside the pool */
+    struct GCephemerons* t = (FIRSTEPHEMERONS->next);
+    for(; t != NULL; t = (t->next))
     {
-        testPassed = 0;
+        unsigned int i = 0;
+        for(; i<(t->capacity); i++)
+        {
+            struct ephemeron* e = &(t->entries[i]);
+            if((e->key) != NULL && (e->value) != NULL 
+               && isMarked(*(e->key)))
+            {
+                recordEdge(*(e->value));
+            }
+        }
     }
     
-    //printAllPages();
-    defrag();
-    return testPassed;
+    /* gc_conservative: what the stack points to */
+    scanStack();
 }
 
-
-
-
-int testRoot(void)
+int gc_snapshot (const char *path)
 {
-    /* mark through the root system */
-    int testPassed = 1;
-    defrag();
-    
-    
-    /* declare nodes on pool memory */
-    struct ListInt** a = (struct ListInt**) gc_malloc(&class_ListInt2);
-    struct ListInt** b = (struct ListInt**) gc_malloc(&class_ListInt2);
-    struct ListInt** d = (struct ListInt**) gc_malloc(&class_ListInt2);
-    struct ListInt** c = (struct ListInt**) gc_malloc(&class_ListInt2);
-    
-    (*a)->n = 1;
-    (*b)->n = 2;
-    (*c)->n = 3;
-    (*d)->n = 42;
-    (*a)->next = b;
-    (*b)->next = c;
-    
-    /* declare root on stack */
-    struct ListInt l1 =  {&class_ListInt2, 1000, a};
-    struct ListInt l2 = {&class_ListInt2, 1001, d};
-    
-    /* create a double pointer to l1 */
-    struct ListInt * l1_ptr = &l1; 
-    struct ListInt ** l1_2ptr = &l1_ptr;
-    
-    struct ListInt* l2_ptr = &l2;
-    struct ListInt** l2_2ptr = &l2_ptr;
-    
-    /* add the root */
-    struct GCroot root = { (struct GCobject **) l1_2ptr, NULL };
-    struct GCroot root2 = { (struct GCobject **) l2_2ptr, NULL};
-    gc_protect(&root);
-    gc_protect(&root2);
-    
-    
-    
-    
-    
-    
-    if( (*(a)) != (*(l1.next)))
+    FILE* out = fopen(path, "wb");
+    if(out == NULL)
     {
-        printf("Error on addresses in l1\n");
-        testPassed = 0;
+        return 0;
     }
-    
-    if( (*(b)) != (*((*a)->next)))
+    /* a big buffer, the records are small */
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    
+    int ok = 1;
+    
+    /* number the classes */
+    struct GCclass** classes = NULL;
+    unsigned int classCount = 0;
+    unsigned int classCapacity = 0;
+    int* classIds = (int*) malloc((PAGECOUNT + 1) * sizeof(int));
+    size_t i = 0;
+    for(; ok && classIds != NULL && i<PAGECOUNT; i++)
     {
-        printf("Error on pointing from a to b\n");
-        testPassed = 0;
+        classIds[i] = snapshotClassId(&classes, &classCount, &classCapacity,
+                                      CLASSOF(PAGES[i]->obj));
+        ok = ok && (classIds[i] >= 0);
     }
+    ok = ok && (classIds != NULL);
     
+    struct ephemeronEdge* ephemerons = NULL;
+    size_t ephemeronCount = 0;
+    ok = ok && ephemeronEdges(&ephemerons, &ephemeronCount);
+    size_t nextEphemeron = 0;
     
-    garbage_collect();
-    
-    //printAllPages();
-
-    
+    recordingEdges = 1;
     
-   
-    if(((*a)->n) != 1)
+    /* the roots are needed in the header */
+    EDGES.size = 0;
+    if(ok)
     {
-        testPassed = 0;
+        recordRootEdges();
     }
-    if(((*c)->n) != 3)
+    uint32_t rootCount = EDGES.size;
+    uint32_t* roots = NULL;
+    if(ok && rootCount > 0)
     {
-        testPassed = 0;
+        roots = (uint32_t*) malloc(rootCount * sizeof(uint32_t));
+        ok = (roots != NULL);
+        if(ok)
+        {
+            memcpy(roots, EDGES.items, rootCount * sizeof(uint32_t));
+        }
     }
-    defrag();
     
-    gc_unprotect(&root);
-    gc_unprotect(&root2);
+    struct GCsnapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GC_SNAP_MAGIC, sizeof(GC_SNAP_MAGIC));
+    header.heapSize = gc_heap_size;
+    syncTelemetry();
+    header.used = TELEMETRY.used;
+    header.classes = classCount;
+    header.objects = (uint32_t) PAGECOUNT;
+    header.roots = rootCount;
+    ok = ok && fwrite(&header, sizeof(header), 1, out) == 1;
+    
+    for(i = 0; ok && i<classCount; i++)
+    {
+        struct GCsnapClass c = {(uint32_t) i, 0, (classes[i]->size)};
+        ok = fwrite(&c, sizeof(c), 1, out) == 1;
+    }
     
-    if(rootLen() != 0)
+    for(i = 0; ok && i<PAGECOUNT; i++)
     {
-        testPassed = 0;
+        page* p = PAGES[i];
+        EDGES.size = 0;
+        struct GCobject* o = (p->obj);
+        gc_markMethod(&o);
+        for(; nextEphemeron < ephemeronCount 
+              && ephemerons[nextEphemeron].key == i; nextEphemeron++)
+        {
+            recordEdge(ephemerons[nextEphemeron].value);
+        }
+        
+        struct GCsnapObject record;
+        memset(&record, 0, sizeof(record));
+        record.offset = (p->left);
+        record.size = (p->size);
+        record.classId = (uint32_t) classIds[i];
+        record.refs = EDGES.size;
+        ok = fwrite(&record, sizeof(record), 1, out) == 1;
+        if(ok && EDGES.size > 0)
+        {
+            ok = fwrite(EDGES.items, sizeof(uint32_t), EDGES.size, out) == EDGES.size;
+        }
     }
     
-    return testPassed;
+    if(ok && rootCount > 0)
+    {
+        ok = fwrite(roots, sizeof(uint32_t), rootCount, out) == rootCount;
+    }
     
+    recordingEdges = 0;
+    free(ephemerons);
+    free(roots);
+    free(classes);
+    free(classIds);
+    free(EDGES.items);
+    EDGES.items = NULL;
+    EDGES.size = 0;
+    EDGES.capacity = 0;
+    
+    if(fclose(out) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
 }
 
+/* --------------------------END-HEAP-SNAPSHOT---------------------------- */
 
 
 
+#ifdef GC_VERIFY
+/* -----------------------BEGIN-HEAP-VERIFICATION------------------------- 
+ * DESCRIPTION
+ * 
+ * Built with GC_VERIFY only (make BUILD=verify), to run real programs
+ * under a collector that checks itself:
+ *      -stress: with GC_VERIFY_EVERY=n in the environment, every n-th
+ *          gc_malloc collects first (gc_set_limit sends every allocation to
+ *          the slow path to count them), so a handle that isn't rooted
+ *          gets caught right away instead of once in a while
+ *      -poison: defrag fills the dead objects and what the moved ones
+ *          left behind with GC_POISON, so a stale raw pointer reads
+ *          garbage that stands out instead of a plausible old object
+ *      -verification: after each defrag, gc_verify_heap walks PAGES, the
+ *          free pages, the roots and the weak references; the first
+ *          problem found aborts the program
+ */
 
+/*GLOBAL STRESS STATE*/
+unsigned long gc_stress_every = 0;
+static unsigned long stressCount = 0;
 
-int main(void)
-{ 
-    
-
-    int goOn = 1;
-    if(goOn)
+const char* gc_verify_heap(void)
+{
+    /* the pages, in order, end to end or with gaps, inside the heap */
+    position end = 0;
+    size_t i = 0;
+    for(; i<PAGECOUNT; i++)
     {
-        /* page system test */
-        if(testPages())
+        page* p = PAGES[i];
+        if(pageOfHandle((uintptr_t) &(p->obj)) != p)
         {
-            printf("pages : ok\n");
+            return "a page isn't a live page of the region";
         }
-        else
+        if((p->left) < end)
         {
-            goOn = 0;
-            printf("PAGES : PROBLEM\n");
+            return "pages out of order or overlapping";
         }
-    }
-    
-    if(goOn)
-    {
-        /* assignment of values test */
-        if (test_valueAssign())
+        if((p->size) < sizeof(struct GCobject) || (p->left) + (p->size) > freep)
         {
-            printf("assign : ok\n");
+            return "a page goes past the end of the allocated heap";
         }
-        else
+        if((p->obj) != (struct GCobject*) &gc_pool[(p->left)])
         {
-            goOn = 0;
-            printf("ASSIGN : PROBLEM\n");
+            return "a handle doesn't point at its object";
         }
-    }
-    
-    
-    if(goOn)
-    {
-        /* defrag and mark test */
-        if(test_defragging())
+        uint32_t header = (p->obj->header);
+        uint32_t class = header >> GC_CLASS_SHIFT;
+        if(class == 0 || class > classCount 
+           || (gc_classes[class]->size) != (p->size))
         {
-            printf("defragging : ok\n");
+            return "an object header has a bad class";
         }
-        else
+        if((header & ((1u << GC_CLASS_SHIFT) - 1)) != 0)
         {
-            goOn = 0;
-            printf("DEFRAGGING : PROBLEM\n");
+            return "an object is still marked after defrag";
         }
-        
+        end = (p->left) + (p->size);
+    }
+    if(freep > gc_heap_size)
+    {
+        return "the allocation pointer is past the heap";
     }
     
-    if(goOn)
+    /* every page handed out is either in PAGES or free */
+    size_t freeCount = 0;
+    page* n = (gc_allocator.nodes);
+    for(; n != NULL; n = (n->next))
     {
-        /* object translation in memory pool test */
-        if(testTranslation())
-        {
-            printf("translation : ok\n");
-        }
-        else
+        if((n->obj) != NULL)
         {
-            goOn = 0;
-            printf("TRANSLATION : PROBLEM\n");
+            return "a free page has an object";
         }
+        freeCount++;
+    }
+    if(PAGECOUNT + freeCount != (size_t) (pagesTop - (page*) (gc_allocator.pages)))
+    {
+        return "pages lost or counted twice";
+    }
+    if((gc_allocator.allocations) - freedObjects != PAGECOUNT)
+    {
+        return "the object count doesn't match the pages";
     }
     
-    if(goOn)
+    /* the roots in the pool hold objects, the weak references handles */
+    struct GCroot* r = (FIRSTROOT->next);
+    for(; r != NULL; r = (r->next))
     {
-        /* general root system test
-         *includes protect, unprotect, marking, garbage collection
-         */
-        if(testRoot())
+        struct GCobject* o = *(r->ptr);
+        if(o != NULL && inPool(o))
         {
-            printf("root functions : ok\n");
+            page* p = pageAt((position) ((byte*) o - gc_pool));
+            if(p == NULL || (p->obj) != o)
+            {
+                return "a root points in the pool but not at an object";
+            }
         }
-        else
+    }
+    struct GCweak* w = (FIRSTWEAK->next);
+    for(; w != NULL; w = (w->next))
+    {
+        if((w->ptr) != NULL && pageOfHandle((uintptr_t) (w->ptr)) == NULL)
         {
-            goOn = 0;
-            printf("ROOT FUNCTIONS : PROBLEM\n");
+            return "a weak reference holds a dead handle";
         }
     }
-    
-    
-   return goOn;
+    return NULL;
+}
 
+/* ------------------------END-HEAP-VERIFICATION-------------------------- */
+#endif
 
-   
- 
-}
\ No newline at end of file
+
+size_t garbage_collect (void)
+{
+   unsigned long long begin = nowNs();
+   beginCollection();
+   size_t start = gc_stats().used;
+   gc_markAll();
+   unsigned long long marked = nowNs();
+   gc_defrag();
+   unsigned long long compacted = nowNs();
+   size_t end = gc_stats().used;
+   if(!deferFinalizers)
+   {
+       /* a finalizer that allocates can start a collection of its own,
+        * which records itself and would overwrite CURRENT */
+       struct GCcollection outer = CURRENT;
+       gc_run_finalizers();
+       CURRENT = outer;
+   }
+   endCollection(begin, marked, compacted, nowNs());
+   return (start - end);
+}
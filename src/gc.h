@@ -3,29 +3,175 @@
 #ifndef GCOBJECT_H
 #define GCOBJECT_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* libgc.so est compilée avec -fvisibility=hidden : seul ce qui est déclaré
+   ici en est exporté.  */
+#pragma GCC visibility push(default)
+
 /* Type des objets gérés par le GC.
    Tout objet géré par le GC doit être une structure qui commence de manière
    identique.  */
 struct GCobject {
-   /* Pointeur sur la structure qui décrit la classe de ces objets.
-      Attention, ce champ peut être temporairement modifié pendant le GC,
-      donc il ne peut pas être utilisé par la méthode `mark'.  */
-   struct GCclass *class;
+   /* En-tête : numéro de la classe de l'objet dans le registre du GC (à
+      partir du bit GC_CLASS_SHIFT) et, en dessous, les bits du GC.
+      Écrit par gc_malloc, ou avec gc_header pour un objet hors du tas.
+      Attention, ce champ est modifié pendant le GC, donc il ne peut pas être
+      utilisé par la méthode `mark'.  */
+   uint32_t header;
 };
 
+#define GC_CLASS_SHIFT 8
+/* Nombre maximal de classes enregistrées.  */
+#define GC_MAX_CLASSES ((1u << (32 - GC_CLASS_SHIFT)) - 1)
+
 /* Type des classes qui décrivent les objets gérés par le GC.  */
 struct GCclass {
-   /* Taille (en bytes) des objets de cette classe.  */
-   int size;
+   /* Taille (en bytes) des objets de cette classe, en-tête compris.  */
+   size_t size;
 
    /* Méthode de marquage des objets de cette classe.
       Appelée par le GC, elle doit appeler `gc_mark' sur chacun des pointeurs
       qui apparaissent dans l'objet `o'.  */
    void (*mark) (struct GCobject **o);
+
+   /* Méthode de finalisation (optionnelle, peut être NULL).
+      Appelée après la récupération d'un objet de cette classe, sur une copie
+      de l'objet mort : les références qu'il contient ne sont plus valides.  */
+   void (*finalize) (struct GCobject *o);
+
+   /* Numéro de la classe dans le registre, attribué par le GC à la
+      première allocation; laisser à 0.  */
+   uint32_t id;
+};
+
+/* En-tête d'un objet de la classe `c' construit hors du tas (racine sur la
+   pile, variable globale), à mettre dans son champ `header'.  Enregistre
+   la classe au besoin.  Renvoie 0 si elle ne peut pas l'être (objets de
+   moins de sizeof (struct GCobject) bytes, registre plein, mémoire).  */
+uint32_t gc_header (struct GCclass *c);
+
+/* Tas.
+   Le tas est réservé à la première allocation, ou par gc_init qui permet de
+   le configurer.  */
+#define GC_HUGE_NONE 0		/* Pages normales.  */
+#define GC_HUGE_TRANSPARENT 1	/* Grandes pages transparentes (madvise).  */
+#define GC_HUGE_EXPLICIT 2	/* Grandes pages réservées (MAP_HUGETLB),
+				   transparentes si le système n'en a pas.  */
+
+struct GCconfig {
+   size_t heapSize;		/* Taille du tas, celle de la compilation
+				   si 0.  */
+   int hugePages;		/* GC_HUGE_*; gc_init y écrit ce qu'il a
+				   obtenu.  */
+   int numaNode;		/* Nœud NUMA où placer le tas, -1 pour
+				   laisser faire le système.  */
+   int prefault;		/* Si non nul, la mémoire du tas est occupée
+				   dès gc_init plutôt qu'au fil des
+				   allocations.  */
 };
+#define GC_CONFIG_DEFAULT { 0, GC_HUGE_NONE, -1, 0 }
+
+/* Réservation du tas selon `config' (GC_CONFIG_DEFAULT si NULL).
+   À appeler avant la première allocation.  Renvoie 0 en cas d'erreur (tas
+   déjà réservé, mémoire ou nœud NUMA indisponible).  */
+int gc_init (struct GCconfig *config);
+
+/* Allocation rapide.
+   Ce qui suit est interne au GC : il est exposé pour que gc_malloc soit
+   intégré à l'appelant, ne pas y toucher.  */
+
+#pragma pack(push, 8)
+
+/* Page : descripteur d'un objet du tas.  Son champ `obj' est le double
+   pointeur rendu par gc_malloc, les pages ne bougent donc jamais.  */
+struct GCpage {
+   size_t left;			/* Position de l'objet dans le tas.  */
+   size_t size;			/* Taille de l'objet.  */
+   struct GCobject *obj;
+   struct GCpage *next;		/* Page libre suivante.  */
+   struct profileSite *sample;	/* Site d'allocation, si échantillonné.  */
+};
+
+/* État de l'allocateur.  Entre `top' et `limit', gc_malloc n'a rien d'autre
+   à faire que d'avancer `top'; `limit' est ramené en deçà de la fin du tas
+   lorsque le profileur attend un échantillon.  */
+struct GCallocator {
+   char *base;			/* Début du tas.  */
+   size_t top;			/* Première position libre.  */
+   size_t limit;		/* Fin de la région d'allocation rapide.  */
+   char *pages;			/* Début de la zone des pages.  */
+   struct GCpage *nodes;	/* Pages libres, chaînées par `next'.  */
+   struct GCpage **order;	/* Pages du tas, dans l'ordre des positions;
+				   il y a toujours de la place pour une
+				   page libre.  */
+   size_t count;		/* Nombre de pages dans le tas.  */
+   unsigned long long allocations; /* Nombre total d'allocations.  */
+   unsigned long long allocatedBytes; /* Total des bytes alloués.  */
+};
+
+#pragma pack(pop)
+
+extern struct GCallocator gc_allocator;
+
+/* Chemin lent de gc_malloc : région épuisée, plus de pages libres,
+   classe pas encore enregistrée ou échantillon à prendre.  */
+struct GCobject **gc_malloc_slow (struct GCclass *c);
+
+/* Allocation d'un nouvel objet de la classe `c'.
+   Renvoie NULL si la mémoire manque (voir gc_on_low_memory), gc_error dit
+   alors pourquoi.  */
+static inline struct GCobject **gc_malloc (struct GCclass *c)
+{
+   struct GCallocator *a = &gc_allocator;
+   struct GCpage *p = a->nodes;
+   size_t memSize = c->size;
+
+   if (__builtin_expect (p == NULL || c->id == 0
+                         || memSize > a->limit - a->top, 0))
+      return gc_malloc_slow (c);
+
+   a->nodes = p->next;
+   p->left = a->top;
+   p->size = memSize;
+   p->obj = (struct GCobject *) (a->base + a->top);
+   p->obj->header = c->id << GC_CLASS_SHIFT;
+   p->sample = NULL;
+   a->order[a->count++] = p;
+   a->top += memSize;
+   a->allocations++;
+   a->allocatedBytes += memSize;
+   return &p->obj;
+}
+
+/* Références compressées.
+   Les handles rendus par gc_malloc sont tous dans une même zone, alignés
+   sur 8 bytes : un objet peut donc garder une référence sur 32 bits au lieu
+   d'un pointeur, jusqu'à GC_MAX_PAGES objets.  0 représente NULL.
+   Le mode conservateur ne reconnaît pas ces références sur la pile.  */
+typedef uint32_t GCref;
+#define GC_REF_SHIFT 3
 
-/* Allocation d'un nouvel objet de la classe `c'.  */
-struct GCobject **gc_malloc (struct GCclass *c);
+static inline GCref gc_compress (struct GCobject **h)
+{
+   if (h == NULL)
+      return 0;
+   return (GCref) (((char *) h - gc_allocator.pages) >> GC_REF_SHIFT);
+}
+
+static inline struct GCobject **gc_decompress (GCref r)
+{
+   if (r == 0)
+      return NULL;
+   return (struct GCobject **) (gc_allocator.pages
+                                + ((size_t) r << GC_REF_SHIFT));
+}
+
+/* Nombre maximal d'objets vivants : la zone des pages est réservée en une
+   fois (sans être occupée) et adressable par une GCref.  */
+#define GC_MAX_PAGES \
+   (((size_t) UINT32_MAX << GC_REF_SHIFT) / sizeof (struct GCpage))
 
 /* Fonction de marquage du GC.
    Cette fonction marque tous les objets accessibles depuis `o'.  */
@@ -42,18 +188,200 @@ void gc_protect (struct GCroot *r);
 /* Élimination d'une racine.  */
 void gc_unprotect (struct GCroot *r);
 
+/* Mode conservateur.
+   Si `bottom' est non NULL, le GC examine la pile entre le point d'appel et
+   `bottom', ainsi que les registres, et considère comme racine toute valeur
+   qui ressemble à une référence vers un objet; les variables locales n'ont
+   alors plus besoin de gc_protect.  Les objets pointés directement ne sont
+   plus déplacés.
+   `bottom' doit être au-dessus de toutes les variables locales concernées :
+   __builtin_frame_address (0) dans `main' convient, l'adresse d'une de ses
+   variables locales non (le compilateur peut intégrer d'autres fonctions
+   dans `main').
+   NULL désactive ce mode.  */
+void gc_conservative (void *bottom);
+
+/* Référence faible : elle ne garde pas l'objet en vie.  */
+struct GCweak {
+   /* Ce champ pointe sur l'objet référencé; le GC le met à NULL lorsque
+      l'objet est récupéré.  */
+   struct GCobject **ptr;
+   /* Ce champ est utilisé par le GC; ne pas toucher.  */
+   struct GCweak *next;
+};
+/* Ajout d'une référence faible `w' vers l'objet `o'.  */
+void gc_weak_ref (struct GCweak *w, struct GCobject **o);
+/* Élimination d'une référence faible.  */
+void gc_weak_unref (struct GCweak *w);
+
+/* Table éphémère : associe des valeurs à des clés, chaque valeur n'étant
+   gardée en vie que tant que sa clé est accessible par ailleurs.
+   Les entrées dont la clé est récupérée disparaissent de la table.  */
+struct GCephemerons;
+/* Création d'une table vide, NULL si la mémoire manque.  */
+struct GCephemerons *gc_ephemerons_new (void);
+/* Destruction d'une table.  */
+void gc_ephemerons_free (struct GCephemerons *t);
+/* Association de `value' à `key'.  Renvoie 0 si la mémoire manque.  */
+int gc_ephemerons_put (struct GCephemerons *t,
+                       struct GCobject **key, struct GCobject **value);
+/* Valeur associée à `key', NULL s'il n'y en a pas.  */
+struct GCobject **gc_ephemerons_get (struct GCephemerons *t,
+                                     struct GCobject **key);
+/* Élimination de l'entrée de clé `key'.  */
+void gc_ephemerons_remove (struct GCephemerons *t, struct GCobject **key);
+/* Nombre d'entrées dans la table.  */
+unsigned int gc_ephemerons_count (struct GCephemerons *t);
+
+/* Exécution des finaliseurs en attente.
+   Renvoie le nombre de finaliseurs exécutés.  */
+int gc_run_finalizers (void);
+/* Si `defer' est non nul, garbage_collect n'exécute plus les finaliseurs;
+   c'est alors à l'application d'appeler gc_run_finalizers hors de la pause.  */
+void gc_defer_finalizers (int defer);
+
 /* Récupération mémoire.
    Il n'est normalement pas nécessaire de l'appeler explicitement, car elle
    est appelée par gc_malloc au besoin.
    Renvoie le nombre de bytes récupérés.  */
-int garbage_collect (void);
+size_t garbage_collect (void);
+
+/* Manque de mémoire.
+   Lorsque le tas est plein même après une collection, gc_malloc fait une
+   collection d'urgence selon la politique choisie par gc_oom_policy, puis
+   appelle la fonction donnée à gc_on_low_memory avec la taille demandée :
+   elle peut libérer des caches de l'application et renvoyer non nul pour
+   que gc_malloc collecte et réessaie (au plus GC_OOM_RETRIES fois), ou 0
+   pour abandonner.  gc_malloc renvoie alors NULL.  */
+#define GC_OOM_FINALIZE 0x1	/* Exécuter les finaliseurs en attente,
+				   même différés, et recollecter.  */
+#define GC_OOM_CLEAR_EPHEMERONS 0x2 /* Vider les tables éphémères, traitées
+				   comme des caches.  */
+#define GC_OOM_DEFAULT GC_OOM_FINALIZE
+#define GC_OOM_RETRIES 8
+void gc_oom_policy (int flags);
+/* Fonction appelée lorsque la mémoire manque, NULL pour aucune.  */
+void gc_on_low_memory (int (*callback) (size_t size));
+
+/* Erreurs de gc_malloc.  */
+#define GC_ERROR_NONE 0
+#define GC_ERROR_NO_HEAP 1	/* Le tas n'a pas pu être réservé.  */
+#define GC_ERROR_BAD_CLASS 2	/* La classe n'a pas pu être enregistrée.  */
+#define GC_ERROR_TOO_LARGE 3	/* Objet plus grand que le tas.  */
+#define GC_ERROR_OUT_OF_MEMORY 4 /* Tas plein, malgré la collection
+				   d'urgence et la fonction de
+				   gc_on_low_memory.  */
+/* Erreur du dernier gc_malloc qui a renvoyé NULL, GC_ERROR_NONE s'il n'y
+   en a pas eu.  */
+int gc_error (void);
 
 /* Fonction de test.  */
 struct GCstats {
-   int count;			/* Nombre d'objets dans le tas.  */
-   int used;			/* Bytes utilisés.  */
-   int free;			/* Bytes restants.  */
+   size_t count;		/* Nombre d'objets dans le tas.  */
+   size_t used;			/* Bytes utilisés par les objets.  */
+   size_t free;			/* Bytes restants.  */
 };
 struct GCstats gc_stats (void);
 
+/* Profileur d'allocations par échantillonnage.
+   Un échantillon (avec la pile d'appels) est pris en moyenne tous les `rate'
+   bytes alloués, GC_PROFILE_RATE si `rate' vaut 0.  Le profileur suit
+   ensuite la survie des objets échantillonnés au fil des collections.  */
+#define GC_PROFILE_RATE 524288
+void gc_profile_start (size_t rate);
+void gc_profile_stop (void);
+/* Écriture du profil dans `path', au format lu par pprof.
+   Renvoie 0 en cas d'erreur.  */
+int gc_profile_dump (const char *path);
+
+/* Écriture d'un instantané du tas dans `path' (objets, classes et
+   références, voir snapshot.h), lu par l'outil d'analyse.  Les références
+   sont celles que suit le GC : méthodes `mark', racines, pile en mode
+   conservatif et, pour les éphémérons, de la clé vers la valeur.
+   Renvoie 0 en cas d'erreur.  */
+int gc_snapshot (const char *path);
+
+/* Historique conservé par la télémétrie (nombre de collections).  */
+#define GC_TELEMETRY_HISTORY 64
+
+/* Mesures d'une collection.  Les durées sont en nanosecondes.  */
+struct GCcollection {
+   unsigned long long id;	/* Numéro de la collection (à partir de 1).  */
+   unsigned long long markTime;	/* Durée du marquage.  */
+   unsigned long long compactTime; /* Durée du compactage.  */
+   unsigned long long finalizeTime; /* Durée des finaliseurs (non différés).  */
+   unsigned long long pauseTime; /* Durée totale de la collection.  */
+   size_t rootsScanned;		/* Racines examinées.  */
+   size_t objectsMarked;	/* Objets marqués.  */
+   size_t objectsFreed;		/* Objets récupérés.  */
+   size_t bytesFreed;		/* Bytes récupérés.  */
+   size_t bytesMoved;		/* Bytes déplacés par le compactage.  */
+   size_t liveObjects;		/* Objets vivants après la collection.  */
+   size_t liveBytes;		/* Bytes utilisés après la collection.  */
+   double allocationRate;	/* Bytes alloués par seconde depuis la
+				   collection précédente.  */
+};
+
+/* Télémétrie du GC, tenue à jour en temps constant.  */
+struct GCtelemetry {
+   size_t objects;		/* Nombre d'objets dans le tas.  */
+   size_t used;			/* Bytes utilisés.  */
+   size_t free;			/* Bytes restants.  */
+   unsigned long long allocations; /* Nombre total d'allocations.  */
+   unsigned long long allocatedBytes; /* Total des bytes alloués.  */
+   unsigned long long collections; /* Nombre de collections.  */
+   unsigned long long totalPause; /* Somme des pauses.  */
+   unsigned long long maxPause;	/* Plus longue pause.  */
+   /* Dernières collections; celle de numéro `id' est dans
+      recent[(id - 1) % GC_TELEMETRY_HISTORY].  */
+   struct GCcollection recent[GC_TELEMETRY_HISTORY];
+};
+/* Télémétrie courante; le pointeur reste valide, son contenu est mis à jour
+   à chaque appel et à chaque collection.  */
+const struct GCtelemetry *gc_get_telemetry (void);
+/* Fonction appelée à la fin de chaque garbage_collect, NULL pour aucune.  */
+void gc_on_collect (void (*callback) (const struct GCcollection *c));
+
+/* Traçage.
+   Chaque événement est une sonde USDT du fournisseur `gc' (si <sys/sdt.h>
+   était là à la compilation), que perf et bpftrace peuvent activer, et peut
+   aussi être gardé dans un journal circulaire.  Désactivés, ils ne coûtent
+   qu'un test, et jamais dans le chemin rapide de gc_malloc.  */
+#define GC_EVENT_ALLOC_SLOW 1	/* Chemin lent de gc_malloc (sonde
+				   alloc__slow) : taille de l'objet.  */
+#define GC_EVENT_MARK_BEGIN 2	/* Début du marquage (mark__begin) :
+				   numéro de la collection.  */
+#define GC_EVENT_MARK_END 3	/* Fin du marquage (mark__end) : objets
+				   marqués.  */
+#define GC_EVENT_DEFRAG_BEGIN 4	/* Début du compactage (defrag__begin) :
+				   objets dans le tas.  */
+#define GC_EVENT_DEFRAG_END 5	/* Fin du compactage (defrag__end) : bytes
+				   récupérés.  */
+#define GC_EVENT_HEAP_GROW 6	/* Mémoire prise par le GC (heap__grow) :
+				   bytes, le tas à sa réservation puis
+				   chaque lot de pages.  */
+#define GC_EVENT_LOW_MEMORY 7	/* Début de la collection d'urgence
+				   (low__memory) : taille demandée.  */
+
+/* Taille du journal par défaut (nombre d'événements).  */
+#define GC_TRACE_SIZE 4096
+
+struct GCevent {
+   unsigned long long time;	/* Horloge monotone, en nanosecondes.  */
+   unsigned int type;		/* GC_EVENT_*.  */
+   unsigned int pad;
+   size_t arg;			/* Selon le type.  */
+};
+/* Début de l'enregistrement dans un journal de `size' événements
+   (GC_TRACE_SIZE si 0); une fois plein, les plus anciens sont écrasés.
+   Renvoie 0 si la mémoire manque.  */
+int gc_trace_start (size_t size);
+/* Fin de l'enregistrement, le journal est libéré.  */
+void gc_trace_stop (void);
+/* Retrait des événements du journal, du plus ancien au plus récent, dans
+   `events' (au plus `max').  Renvoie le nombre d'événements retirés.  */
+size_t gc_trace_read (struct GCevent *events, size_t max);
+
+#pragma GCC visibility pop
+
 #endif
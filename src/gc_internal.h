@@ -0,0 +1,98 @@
+/* gc_internal.h --- Structures internes du gestionnaire mémoire.
+   Partagées par gc.c et ses tests; les programmes n'utilisent que gc.h.  */
+
+#ifndef GCINTERNAL_H
+#define GCINTERNAL_H
+
+#include "gc.h"
+
+/* Taille du tas par défaut, modifiable à la compilation (-DHEAPSIZE=...)
+   et, pour un programme, par gc_init.  */
+#ifndef HEAPSIZE
+#define HEAPSIZE 33554432
+#endif
+
+typedef char byte;
+typedef size_t position;
+
+/* Profondeur des piles et nombre de listes du profileur.  */
+#define PROFILE_DEPTH 32
+#define PROFILE_BUCKETS 1024
+
+/* Site d'allocation échantillonné par le profileur.  */
+struct profileSite
+{
+    unsigned int depth;
+    void* stack[PROFILE_DEPTH];
+    unsigned long long allocCount;
+    unsigned long long allocBytes;
+    unsigned long long liveCount;
+    unsigned long long liveBytes;
+    unsigned long long survived;    /* collections survived by its samples */
+    struct profileSite* next;       /* same bucket */
+};
+
+/* Page : un objet du tas (struct GCpage, dans gc.h avec le chemin rapide de
+   gc_malloc).  */
+typedef struct GCpage page;
+
+/* Nombre de pages prises d'un coup dans leur zone, et taille de la zone :
+   chaque objet occupe au moins son en-tête dans le tas.  */
+#define PAGE_SLAB 4096
+#define PAGE_OBJECTS (gc_heap_size/sizeof(struct GCobject) + 1)
+#define PAGE_REGION \
+   ((PAGE_OBJECTS < GC_MAX_PAGES) ? PAGE_OBJECTS : GC_MAX_PAGES)
+
+/* Bits du GC dans l'en-tête des objets, sous GC_CLASS_SHIFT.  */
+#define GC_MARKED 0x1		/* Accessible.  */
+#define GC_PINNED 0x2		/* Accessible et pointé directement depuis la
+				   pile : ne bouge pas.  */
+
+/* Registre des classes : gc_classes[i] est la classe de numéro i, NULL pour
+   0.  */
+extern struct GCclass** gc_classes;
+#define CLASSOF(o) (gc_classes[((o)->header) >> GC_CLASS_SHIFT])
+
+/* Le tas (NULL tant qu'il n'est pas réservé) et ses pages.  La première
+   position libre et le tableau des pages, dans l'ordre des positions, sont
+   tenus par l'allocateur.  */
+extern byte* gc_pool;
+extern size_t gc_heap_size;
+#define freep (gc_allocator.top)
+#define PAGES (gc_allocator.order)
+#define PAGECOUNT (gc_allocator.count)
+
+/* Listes des références faibles et des sites échantillonnés.  */
+extern struct GCweak gc_weak_anchor;
+extern struct profileSite* gc_sites[PROFILE_BUCKETS];
+
+/* Système de pages.  */
+struct GCobject** gc_add_page(struct GCclass* class);
+void gc_defrag(void);
+void gc_set_limit(void);
+
+/* Marquage.  */
+int gc_root_len(void);
+
+/* Profileur.  */
+void gc_clear_profile(void);
+
+/* Affichage des pages, des compteurs et des sites, pour la mise au
+   point.  */
+void gc_print_page(page* p);
+void gc_print_pages();
+void gc_print_stats();
+void gc_print_profile(int top);
+
+#ifdef GC_VERIFY
+/* Mode de vérification (make BUILD=verify) : une collection tous les
+   `gc_stress_every' gc_malloc (variable d'environnement GC_VERIFY_EVERY, 0
+   pour aucune), la place libérée par le compactage remplie de GC_POISON et
+   le tas vérifié après chaque compactage.  */
+#define GC_POISON ((byte) 0xA5)
+extern unsigned long gc_stress_every;
+/* Première incohérence du tas, NULL s'il n'y en a pas.  */
+const char* gc_verify_heap(void);
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+/* snapshot.h --- Format des instantanés du tas écrits par gc_snapshot.  */
+
+#ifndef GCSNAPSHOT_H
+#define GCSNAPSHOT_H
+
+#include <stdint.h>
+
+/* Un instantané est une suite d'entiers dans l'ordre des octets de la
+   machine qui l'a écrit :
+
+     en-tête       struct GCsnapHeader
+     classes       `classes' fois struct GCsnapClass
+     objets        `objects' fois struct GCsnapObject, chacun suivi de
+                   `refs' indices (uint32_t) des objets qu'il référence
+     racines       `roots' indices (uint32_t) des objets référencés par
+                   les racines
+
+   Les objets sont numérotés de 0 à objects - 1, dans l'ordre du tas.  */
+
+#define GC_SNAP_MAGIC "GCSNAP2"
+
+struct GCsnapHeader {
+   char magic[8];		/* GC_SNAP_MAGIC, terminé par '\0'.  */
+   uint64_t heapSize;		/* Taille du tas.  */
+   uint64_t used;		/* Bytes utilisés.  */
+   uint32_t classes;		/* Nombre de classes.  */
+   uint32_t objects;		/* Nombre d'objets.  */
+   uint32_t roots;		/* Nombre de références depuis les racines.  */
+   uint32_t pad;
+};
+
+struct GCsnapClass {
+   uint32_t id;			/* Numéro de la classe dans l'instantané.  */
+   uint32_t pad;
+   uint64_t size;		/* Taille de ses objets.  */
+};
+
+struct GCsnapObject {
+   uint64_t offset;		/* Position dans le tas.  */
+   uint64_t size;		/* Taille, en-têtes du GC compris.  */
+   uint32_t classId;		/* Numéro de sa classe.  */
+   uint32_t refs;		/* Nombre de références sortantes.  */
+};
+
+#endif
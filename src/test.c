@@ -5,73 +5,92 @@
 #include "stdio.h"
 
 //#define XY(x,y) x##y concatenates
-#define GC_MALLOC(t, v) struct t *v = (struct t *)gc_malloc(&class_##t)
+#define GC_MALLOC(t, v) struct t **v = (struct t **)gc_malloc(&class_##t)
 #define GC_MARK(o) gc_mark((struct GCobject *)(o))
 #define GC_ROOT(r, p)				\
    struct GCroot r = { (struct GCobject **)&p, NULL };	\
 
+/* gc_malloc rend un double pointeur : les listes sont des `struct ListInt **'
+   et `next' en est un aussi.  */
 struct ListInt {
-   struct GCclass *class;
+   uint32_t header;
    int n;
-   struct ListInt *next;
+   struct ListInt **next;
 };
 
 
-void mark_ListInt (struct GCobject *o)
+void mark_ListInt (struct GCobject **o)
 {
-   struct ListInt *l = (struct ListInt *)o;
-   GC_MARK (l->next);
+   struct ListInt *l = (struct ListInt *)*o;
+   if (l->next != NULL)
+      GC_MARK (*l->next);
 }
 
 
-struct GCclass class_ListInt = { sizeof (struct ListInt), mark_ListInt };
+struct GCclass class_ListInt = { sizeof (struct ListInt), mark_ListInt, NULL };
 
 
-struct ListInt* cons (int car, struct ListInt *cdr)
+struct ListInt** cons (int car, struct ListInt **cdr)
 {
    GC_MALLOC (ListInt, l);
-   l->n = car;
-   l->next = cdr;
+   if (l == NULL)
+     {
+      printf ("cons: out of memory (error %d)\n", gc_error ());
+      exit (1);
+     }
+   (*l)->n = car;
+   (*l)->next = cdr;
    return l;
 }
 
+int failed = 0;
+
 void print_stats (void)
 {
    struct GCstats before = gc_stats ();
-   int freed = garbage_collect ();
+   size_t freed = garbage_collect ();
    struct GCstats after = gc_stats ();
-   printf ("Count = %d -> %d; Used = %d -> %d; Free = %d -> %d\n",
+   printf ("Count = %zu -> %zu; Used = %zu -> %zu; Free = %zu -> %zu\n",
 	   before.count, after.count,
 	   before.used, after.used,
 	   before.free, after.free);
-   if (freed < 0
+   if (freed > before.used
        || before.free + freed != after.free
        || before.used != after.used + freed
        || (freed == 0
-	   ? before.count == after.count
-	   : before.count > after.count))
+	   ? before.count != after.count
+	   : before.count <= after.count))
+     {
       printf ("GC's stats inconsistency!\n");
+      failed = 1;
+     }
 }
 
 int main (int narg, char **args)
 {
-   struct ListInt *l1 = NULL, *l2 = NULL;
+   /* Les racines sont des listes sur la pile, hors du tas : le GC appelle
+      leur méthode de marquage, qui marque la liste du tas dans `next'.  */
+   struct ListInt root1 = { gc_header (&class_ListInt), 0, NULL };
+   struct ListInt root2 = { gc_header (&class_ListInt), 0, NULL };
+   struct ListInt *l1 = &root1, *l2 = &root2;
    int i;
+   (void) narg;
+   (void) args;
    GC_ROOT (r1, l1);
    GC_ROOT (r2, l2);
    gc_protect (&r1);
    gc_protect (&r2);
    print_stats ();
    for (i = 0; i < 100; i++)
-      l1 = cons (i, l1);
+      l1->next = cons (i, l1->next);
    print_stats ();
-   l2 = l1;
+   l2->next = l1->next;
    for (i = 0; i < 100; i++)
-      l1 = cons (i, l1);
+      l1->next = cons (i, l1->next);
    for (i = 0; i < 100; i++)
-      l2 = cons (i, l2);
+      l2->next = cons (i, l2->next);
    print_stats ();
-   l1->next = l1;
+   (*l1->next)->next = l1->next;
    print_stats ();
-   return 0;
+   return failed;
 }
@@ -0,0 +1,1607 @@
+/* test_gc.c --- Tests unitaires du gestionnaire mémoire.  */
+
+#include "gc.h"
+#include "gc_internal.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#pragma pack(1)
+
+
+int testHeap(void)
+{
+    /* reserved once, aligned if it got huge pages */
+    int testPassed = 1;
+    struct GCconfig config = GC_CONFIG_DEFAULT;
+    config.hugePages = GC_HUGE_TRANSPARENT;
+#if HEAPSIZE <= 268435456
+    /* prefaulting commits the whole heap, only for a small one */
+    config.prefault = 1;
+#endif
+    
+    if(!gc_init(&config) || gc_pool == NULL || gc_heap_size != HEAPSIZE)
+    {
+        testPassed = 0;
+    }
+    if((config.hugePages) == GC_HUGE_TRANSPARENT 
+       && ((uintptr_t) gc_pool) % (2 << 20) != 0)
+    {
+        testPassed = 0;
+    }
+    if((config.hugePages) == GC_HUGE_EXPLICIT || gc_init(NULL))
+    {
+        testPassed = 0;
+    }
+    if(gc_stats().free != HEAPSIZE)
+    {
+        testPassed = 0;
+    }
+    return testPassed;
+}
+
+struct GCclass testStruct1 = {250, NULL};
+struct GCclass testStruct2 = {1000, NULL};
+int testPages(void)
+{
+    int testPassed = 1;
+
+    gc_add_page(&testStruct1);
+    gc_add_page(&testStruct2);
+
+    ((struct GCobject*) gc_pool)->header |= GC_MARKED;
+    struct GCstats g = gc_stats();
+    
+    if(g.count != 2)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    
+    g = gc_stats();
+    if(g.count != 1)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    
+    return testPassed;
+}
+
+
+
+
+/* Linked list of integers */
+struct ListInt {
+   uint32_t header;
+   int n;
+   struct ListInt ** next;
+   
+};
+
+void mark_ListInt(struct GCobject **o)
+{
+    /* marking for ListInt
+     * We only mark the next object, gc_mark takes care of the rest.
+     */
+    struct ListInt ** l = (struct ListInt**) o;
+    
+    if(((*l)->next) != NULL)
+    {
+        gc_mark((struct GCobject *) (*((*l)->next)));
+    }
+}
+
+struct GCclass class_ListInt = { sizeof (struct ListInt), NULL };
+
+struct GCclass class_ListInt2 = {sizeof (struct ListInt), &mark_ListInt};
+
+struct ListInt** cons (int car, struct ListInt **cdr)
+{
+    struct ListInt** l = (struct ListInt**) gc_malloc(&class_ListInt);
+    if(l == NULL)
+    {
+        return NULL;
+    }
+    (*l)->n = car;
+    (*l)->next = cdr;
+    return l;
+}
+
+
+int test_valueAssign(void)
+{
+    int testPassed = 1;
+    struct ListInt** g = (struct ListInt**) gc_malloc(&class_ListInt);
+    
+    /* try assigning  */
+    ((*g)->n)= 25;
+    if(((*g)->n) != 25)
+    {
+        testPassed = 0;
+    }
+    
+    struct GCstats s = gc_stats();
+    
+    /* verify that one object is counted */
+    if(s.count != 1)
+    {
+        testPassed = 0;
+    }
+    
+    
+    /* verify that the object is freed */
+    gc_defrag();
+    struct GCstats s2 = gc_stats();
+    if(s2.count != 0 )
+    {
+        testPassed = 0;
+    }
+    
+    
+    return testPassed;
+    
+
+}
+
+
+
+void printArray(int begin, int end)
+{
+    /* low level byte array printing function */
+    if( begin >= 0 && end < HEAPSIZE)
+    {
+        for( ; begin < end; begin ++)
+        {
+            printf("pool[%d] = %c\n",begin, gc_pool[begin]);
+        }
+    }
+}
+
+
+int test_defragging(void)
+{
+    int testPassed = 1;
+    struct ListInt** g = (struct ListInt**) gc_malloc(&class_ListInt);
+    
+    /* try assigning  */
+    ((*g)->n)= 25;
+    //((*g)->class) = (&class_ListInt);
+    
+    /* check value */
+    if(((*g)->n) != 25)
+    {
+        testPassed = 0;
+    }
+    
+    /* Mark the structure */
+    gc_mark((struct GCobject*)(*g));
+    
+
+    /* Test the defrag function */
+    gc_defrag();
+    
+    struct GCstats s = gc_stats();
+    if(s.count != 1)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    s = gc_stats();
+    if(s.count != 0)
+    {
+        testPassed = 0;
+    }
+    
+    return testPassed;
+}
+
+int testTranslation(void)
+{
+    /* create 4 objects, mark 2nd and 4th, defrag and query the values */
+    int testPassed = 1;
+    
+    struct ListInt ** l1 = (struct ListInt**) gc_malloc(&class_ListInt);
+    struct ListInt ** l2 = (struct ListInt**) gc_malloc(&class_ListInt);
+    struct ListInt ** l3 = (struct ListInt**) gc_malloc(&class_ListInt);
+    struct ListInt ** l4 = (struct ListInt**) gc_malloc(&class_ListInt);
+    
+    (*l1)->n = 1;
+    (*l2)->n = 2;
+    (*l3)->n = 3;
+    (*l4)->n = 4;
+    
+    gc_mark((struct GCobject *)(*l2));
+    gc_mark((struct GCobject *)(*l4));
+    
+    //gc_print_pages();
+    gc_defrag();
+    struct GCstats s = gc_stats();
+    if(s.count != 2)
+    {
+        testPassed = 0;
+    }
+    
+
+    if(((*l2)->n) != 2)
+    {
+        testPassed = 0;
+    }
+    if(((*l4)->n) != 4)
+    {
+        testPassed = 0;
+    }
+    
+    //gc_print_pages();
+    gc_defrag();
+    return testPassed;
+}
+
+
+
+
+int testRoot(void)
+{
+    /* mark through the root system */
+    int testPassed = 1;
+    gc_defrag();
+    
+    
+    /* declare nodes on pool memory */
+    struct ListInt** a = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** b = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** d = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** c = (struct ListInt**) gc_malloc(&class_ListInt2);
+    
+    (*a)->n = 1;
+    (*b)->n = 2;
+    (*c)->n = 3;
+    (*d)->n = 42;
+    (*a)->next = b;
+    (*b)->next = c;
+    (*c)->next = NULL;
+    (*d)->next = NULL;
+    
+    /* declare root on stack */
+    struct ListInt l1 =  {gc_header(&class_ListInt2), 1000, a};
+    struct ListInt l2 = {gc_header(&class_ListInt2), 1001, d};
+    
+    /* create a double pointer to l1 */
+    struct ListInt * l1_ptr = &l1; 
+    struct ListInt ** l1_2ptr = &l1_ptr;
+    
+    struct ListInt* l2_ptr = &l2;
+    struct ListInt** l2_2ptr = &l2_ptr;
+    
+    /* add the root */
+    struct GCroot root = { (struct GCobject **) l1_2ptr, NULL };
+    struct GCroot root2 = { (struct GCobject **) l2_2ptr, NULL};
+    gc_protect(&root);
+    gc_protect(&root2);
+    
+    
+    
+    
+    
+    
+    if( (*(a)) != (*(l1.next)))
+    {
+        printf("Error on addresses in l1\n");
+        testPassed = 0;
+    }
+    
+    if( (*(b)) != (*((*a)->next)))
+    {
+        printf("Error on pointing from a to b\n");
+        testPassed = 0;
+    }
+    
+    
+    garbage_collect();
+    
+    //gc_print_pages();
+
+    
+    
+   
+    if(((*a)->n) != 1)
+    {
+        testPassed = 0;
+    }
+    if(((*c)->n) != 3)
+    {
+        testPassed = 0;
+    }
+    gc_defrag();
+    
+    gc_unprotect(&root);
+    gc_unprotect(&root2);
+    
+    if(gc_root_len() != 0)
+    {
+        testPassed = 0;
+    }
+    
+    return testPassed;
+    
+}
+
+
+
+
+
+/* Object holding an external resource, released by its finalizer */
+struct Resource {
+   uint32_t header;
+   char* external;
+};
+
+int finalized = 0;
+
+void finalize_Resource(struct GCobject *o)
+{
+    struct Resource* r = (struct Resource*) o;
+    free(r->external);
+    finalized++;
+}
+
+struct GCclass class_Resource = {sizeof (struct Resource), NULL, &finalize_Resource};
+struct GCclass class_Resource2 = {sizeof (struct Resource) + 7, NULL, NULL};
+
+int testWeak(void)
+{
+    /* a weak reference to a dead object is cleared, not the others */
+    int testPassed = 1;
+    gc_defrag();
+    
+    struct ListInt** a = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** b = (struct ListInt**) gc_malloc(&class_ListInt2);
+    (*a)->n = 1;
+    (*a)->next = NULL;
+    (*b)->n = 2;
+    (*b)->next = NULL;
+    
+    /* only a is reachable from the root */
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, a};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    
+    struct GCweak wa = {NULL, NULL};
+    struct GCweak wb = {NULL, NULL};
+    gc_weak_ref(&wa, (struct GCobject **) a);
+    gc_weak_ref(&wb, (struct GCobject **) b);
+    
+    garbage_collect();
+    
+    if((wa.ptr) != (struct GCobject **) a || ((*a)->n) != 1)
+    {
+        testPassed = 0;
+    }
+    if((wb.ptr) != NULL)
+    {
+        testPassed = 0;
+    }
+    
+    gc_weak_unref(&wa);
+    gc_weak_unref(&wb);
+    gc_unprotect(&root);
+    gc_defrag();
+    
+    if((gc_weak_anchor.next) != NULL)
+    {
+        testPassed = 0;
+    }
+    
+    return testPassed;
+}
+
+int testFinalizers(void)
+{
+    /* dead objects are finalized in a batch after the collection */
+    int testPassed = 1;
+    gc_defrag();
+    finalized = 0;
+    
+    int i = 0;
+    for(; i<3; i++)
+    {
+        struct Resource** r = (struct Resource**) gc_malloc(&class_Resource);
+        (*r)->external = (char*) malloc(64);
+        /* objects without finalizer in between */
+        gc_malloc(&class_Resource2);
+    }
+    
+    garbage_collect();
+    if(finalized != 3)
+    {
+        testPassed = 0;
+    }
+    
+    /* deferred, they only run when asked to */
+    gc_defer_finalizers(1);
+    struct Resource** r = (struct Resource**) gc_malloc(&class_Resource);
+    (*r)->external = (char*) malloc(64);
+    garbage_collect();
+    if(finalized != 3)
+    {
+        testPassed = 0;
+    }
+    if(gc_run_finalizers() != 1 || finalized != 4)
+    {
+        testPassed = 0;
+    }
+    gc_defer_finalizers(0);
+    
+    return testPassed;
+}
+
+int testEphemerons(void)
+{
+    /* a value lives as long as its key, even through other entries */
+    int testPassed = 1;
+    gc_defrag();
+    
+    struct GCephemerons* t = gc_ephemerons_new();
+    struct ListInt** k1 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** v1 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** k2 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** v2 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** k3 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** v3 = (struct ListInt**) gc_malloc(&class_ListInt2);
+    (*k1)->next = NULL;
+    (*k2)->next = NULL;
+    (*k3)->next = NULL;
+    (*v2)->next = NULL;
+    (*v3)->next = NULL;
+    (*v3)->n = 3;
+    /* k3 is only reachable through the value of k1 */
+    (*v1)->next = k3;
+    (*v1)->n = 1;
+    
+    gc_ephemerons_put(t, (struct GCobject **) k1, (struct GCobject **) v1);
+    gc_ephemerons_put(t, (struct GCobject **) k2, (struct GCobject **) v2);
+    gc_ephemerons_put(t, (struct GCobject **) k3, (struct GCobject **) v3);
+    
+    /* only k1 is reachable from the root */
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, k1};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    
+    garbage_collect();
+    
+    /* k1, v1, k3, v3 */
+    if(gc_stats().count != 4 || gc_ephemerons_count(t) != 2)
+    {
+        testPassed = 0;
+    }
+    if(gc_ephemerons_get(t, (struct GCobject **) k1) != (struct GCobject **) v1
+       || ((*v1)->n) != 1)
+    {
+        testPassed = 0;
+    }
+    if(gc_ephemerons_get(t, (struct GCobject **) k3) != (struct GCobject **) v3
+       || ((*v3)->n) != 3)
+    {
+        testPassed = 0;
+    }
+    
+    /* once the key is unreachable, the whole chain goes */
+    gc_unprotect(&root);
+    garbage_collect();
+    if(gc_stats().count != 0 || gc_ephemerons_count(t) != 0)
+    {
+        testPassed = 0;
+    }
+    
+    /* growing and removing */
+    int i = 0;
+    for(; i<100; i++)
+    {
+        struct ListInt** k = (struct ListInt**) gc_malloc(&class_ListInt2);
+        (*k)->next = NULL;
+        (*k)->n = i;
+        gc_ephemerons_put(t, (struct GCobject **) k, (struct GCobject **) k);
+        if(i%2 == 0)
+        {
+            gc_ephemerons_remove(t, (struct GCobject **) k);
+        }
+        if(i%2 == 1 && gc_ephemerons_get(t, (struct GCobject **) k) 
+           != (struct GCobject **) k)
+        {
+            testPassed = 0;
+        }
+    }
+    if(gc_ephemerons_count(t) != 50)
+    {
+        testPassed = 0;
+    }
+    
+    gc_ephemerons_free(t);
+    gc_defrag();
+    return testPassed;
+}
+
+/* bottom of the stack, for the conservative mode */
+void* testStackBottom = NULL;
+/* globals aren't scanned, the test keeps a handle here */
+struct ListInt** pinnedHandle = NULL;
+
+int testConservative(void)
+{
+    /* no root registered, the stack keeps the objects alive */
+    int testPassed = 1;
+    gc_defrag();
+    gc_conservative(testStackBottom);
+    
+    /* a stale word of the stack can keep it, it is marked then */
+    (*(struct ListInt**) gc_malloc(&class_ListInt2))->next = NULL;
+    struct ListInt** volatile h = (struct ListInt**) gc_malloc(&class_ListInt2);
+    pinnedHandle = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt* volatile raw = (*pinnedHandle);
+    (*h)->n = 7;
+    (*h)->next = NULL;
+    raw->n = 9;
+    raw->next = NULL;
+    
+    garbage_collect();
+    
+    /* the handle survived, the raw pointer too, and didn't move */
+    if(((*h)->n) != 7)
+    {
+        testPassed = 0;
+    }
+    if((*pinnedHandle) != raw || (raw->n) != 9)
+    {
+        testPassed = 0;
+    }
+    
+    /* the pin only lasts one collection, a handle on the stack is enough */
+    struct ListInt** volatile ph = pinnedHandle;
+    raw = NULL;
+    garbage_collect();
+    if(((*h)->n) != 7 || ((*ph)->n) != 9)
+    {
+        testPassed = 0;
+    }
+    
+    gc_conservative(NULL);
+    h = NULL;
+    ph = NULL;
+    gc_defrag();
+    pinnedHandle = NULL;
+    return testPassed;
+}
+
+/* collection records received by the callback */
+int collectCalls = 0;
+unsigned long long lastCollectId = 0;
+
+void onCollect(const struct GCcollection *c)
+{
+    collectCalls++;
+    lastCollectId = (c->id);
+}
+
+/* Finalizer that allocates more than the heap, so it collects */
+struct GCclass class_Eighth = {HEAPSIZE/8, NULL};
+
+void finalize_Allocating(struct GCobject *o)
+{
+    int i;
+    for(i = 0; i < 12; i++)
+    {
+        gc_malloc(&class_Eighth);
+    }
+}
+
+struct GCclass class_Allocating = {sizeof (struct ListInt), NULL, 
+                                   &finalize_Allocating};
+
+int testTelemetry(void)
+{
+    /* the counters follow allocations and collections */
+    int testPassed = 1;
+    gc_defrag();
+    gc_on_collect(&onCollect);
+    
+    const struct GCtelemetry* t = gc_get_telemetry();
+    unsigned long long allocations = (t->allocations);
+    unsigned long long collections = (t->collections);
+    
+    struct ListInt** a = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** b = (struct ListInt**) gc_malloc(&class_ListInt2);
+    gc_malloc(&class_ListInt2);
+    (*a)->next = b;
+    (*b)->next = NULL;
+    /* gc_malloc doesn't touch the telemetry, it is brought up to date here */
+    t = gc_get_telemetry();
+    if((t->allocations) != allocations+3 || (t->objects) != 3)
+    {
+        testPassed = 0;
+    }
+    
+    /* dead objects in front, so that a and b move */
+    gc_malloc(&class_ListInt2);
+    (*a)->next = NULL;
+    struct ListInt** c = (struct ListInt**) gc_malloc(&class_ListInt2);
+    (*c)->next = b;
+    
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, c};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    garbage_collect();
+    gc_unprotect(&root);
+    
+    const struct GCcollection* r = 
+        &(t->recent[((t->collections) - 1) % GC_TELEMETRY_HISTORY]);
+    if((t->collections) != collections+1 || collectCalls != 1 
+       || lastCollectId != (t->collections) || (r->id) != (t->collections))
+    {
+        testPassed = 0;
+    }
+    /* c and b marked, a and 2 others freed, both moved */
+    if((r->rootsScanned) != 1 || (r->objectsMarked) != 2 
+       || (r->objectsFreed) != 3 || (r->liveObjects) != 2
+       || (r->bytesMoved) != 2*sizeof(struct ListInt))
+    {
+        testPassed = 0;
+    }
+    if((r->pauseTime) < (r->markTime) + (r->compactTime)
+       || (t->maxPause) < (r->pauseTime))
+    {
+        testPassed = 0;
+    }
+    if((t->objects) != 2 || (t->used) + (t->free) != HEAPSIZE
+       || gc_stats().count != 2)
+    {
+        testPassed = 0;
+    }
+    
+    /* a collection started by a finalizer has its own record */
+    collections = (t->collections);
+    collectCalls = 0;
+    gc_malloc(&class_Allocating);
+    garbage_collect();
+    t = gc_get_telemetry();
+    if(collectCalls < 2 || (t->collections) != collections + collectCalls
+       || lastCollectId != collections+1)
+    {
+        testPassed = 0;
+    }
+    unsigned long long id;
+    for(id = collections+1; id <= (t->collections); id++)
+    {
+        if((t->recent[(id - 1) % GC_TELEMETRY_HISTORY].id) != id)
+        {
+            testPassed = 0;
+        }
+    }
+    
+    gc_on_collect(NULL);
+    gc_defrag();
+    return testPassed;
+}
+
+int testProfiler(void)
+{
+    /* sample everything, keep half, dump */
+    int testPassed = 1;
+    gc_defrag();
+    gc_profile_start(1);
+    
+    struct ListInt** list = NULL;
+    int i = 0;
+    for(; i<10; i++)
+    {
+        struct ListInt** l = (struct ListInt**) gc_malloc(&class_ListInt2);
+        (*l)->n = i;
+        (*l)->next = NULL;
+        if(i%2 == 0)
+        {
+            (*l)->next = list;
+            list = l;
+        }
+    }
+    gc_profile_stop();
+    /* not sampled anymore */
+    gc_malloc(&class_ListInt2);
+    
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, list};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    garbage_collect();
+    garbage_collect();
+    gc_unprotect(&root);
+    
+    /* a single site, 10 samples, 5 survivors, twice */
+    unsigned long long allocCount = 0, liveCount = 0, survived = 0;
+    for(i = 0; i<PROFILE_BUCKETS; i++)
+    {
+        struct profileSite* site = gc_sites[i];
+        for(; site != NULL; site = (site->next))
+        {
+            allocCount += (site->allocCount);
+            liveCount += (site->liveCount);
+            survived += (site->survived);
+        }
+    }
+    if(allocCount != 10 || liveCount != 5 || survived != 10)
+    {
+        testPassed = 0;
+    }
+    
+    if(!gc_profile_dump("gc_test.heap"))
+    {
+        testPassed = 0;
+    }
+    else
+    {
+        char line[64] = {0};
+        FILE* in = fopen("gc_test.heap", "r");
+        if(in == NULL || fgets(line, sizeof(line), in) == NULL
+           || strncmp(line, "heap profile:      5:", 21) != 0)
+        {
+            testPassed = 0;
+        }
+        if(in != NULL)
+        {
+            fclose(in);
+        }
+        remove("gc_test.heap");
+    }
+    
+    gc_defrag();
+    gc_clear_profile();
+    return testPassed;
+}
+
+int testSnapshot(void)
+{
+    /* a -> b -> c from a root, d unreachable, read the file back */
+    int testPassed = 1;
+    gc_defrag();
+    
+    struct ListInt** a = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** b = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** c = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** d = (struct ListInt**) gc_malloc(&class_Resource2);
+    (*a)->next = b;
+    (*b)->next = c;
+    (*c)->next = NULL;
+    (void) d;
+    
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, a};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    int written = gc_snapshot("gc_test.snap");
+    gc_unprotect(&root);
+    
+    FILE* in = fopen("gc_test.snap", "rb");
+    if(!written || in == NULL)
+    {
+        testPassed = 0;
+    }
+    else
+    {
+        struct GCsnapHeader header;
+        struct GCsnapClass classes[2];
+        struct GCsnapObject record;
+        uint32_t edge = 0;
+        if(fread(&header, sizeof(header), 1, in) != 1
+           || strcmp(header.magic, GC_SNAP_MAGIC) != 0
+           || header.objects != 4 || header.classes != 2 || header.roots != 1
+           || fread(classes, sizeof(struct GCsnapClass), 2, in) != 2
+           || classes[1].size != (sizeof (struct Resource) + 7))
+        {
+            testPassed = 0;
+        }
+        /* a references b */
+        else if(fread(&record, sizeof(record), 1, in) != 1
+                || record.refs != 1 || record.classId != 0
+                || fread(&edge, sizeof(edge), 1, in) != 1 || edge != 1)
+        {
+            testPassed = 0;
+        }
+        fclose(in);
+    }
+    remove("gc_test.snap");
+    
+    /* the marks were left alone */
+    gc_defrag();
+    if(gc_stats().count != 0)
+    {
+        testPassed = 0;
+    }
+    
+    /* k rooted holds v through an ephemeron, w is only on the stack */
+    struct GCephemerons* t = gc_ephemerons_new();
+    struct ListInt** k = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** v = (struct ListInt**) gc_malloc(&class_ListInt2);
+    struct ListInt** volatile w = 
+        (struct ListInt**) gc_malloc(&class_ListInt2);
+    (*k)->next = NULL;
+    (*v)->next = NULL;
+    (*w)->next = NULL;
+    gc_ephemerons_put(t, (struct GCobject **) k, (struct GCobject **) v);
+    l1.next = k;
+    gc_protect(&root);
+    gc_conservative(testStackBottom);
+    garbage_collect();
+    written = (gc_stats().count == 3) && gc_snapshot("gc_test.snap");
+    gc_conservative(NULL);
+    gc_unprotect(&root);
+    
+    in = fopen("gc_test.snap", "rb");
+    if(!written || in == NULL)
+    {
+        testPassed = 0;
+    }
+    else
+    {
+        struct GCsnapHeader header;
+        struct GCsnapClass classes[1];
+        struct GCsnapObject record;
+        uint32_t edges[16];
+        if(fread(&header, sizeof(header), 1, in) != 1
+           || header.objects != 3 || header.classes != 1
+           || header.roots < 2 || header.roots > 16
+           || fread(classes, sizeof(struct GCsnapClass), 1, in) != 1)
+        {
+            testPassed = 0;
+        }
+        /* k references v, v and w nothing */
+        else if(fread(&record, sizeof(record), 1, in) != 1 || record.refs != 1
+                || fread(edges, sizeof(uint32_t), 1, in) != 1 || edges[0] != 1
+                || fread(&record, sizeof(record), 1, in) != 1 
+                || record.refs != 0
+                || fread(&record, sizeof(record), 1, in) != 1 
+                || record.refs != 0
+                || fread(edges, sizeof(uint32_t), header.roots, in) 
+                   != header.roots)
+        {
+            testPassed = 0;
+        }
+        else
+        {
+            /* the root l1 holds k, the stack holds w */
+            int rootK = 0, rootW = 0;
+            uint32_t i = 0;
+            for(; i<header.roots; i++)
+            {
+                rootK = rootK || edges[i] == 0;
+                rootW = rootW || edges[i] == 2;
+            }
+            if(!rootK || !rootW)
+            {
+                testPassed = 0;
+            }
+        }
+        fclose(in);
+    }
+    remove("gc_test.snap");
+    
+    gc_ephemerons_free(t);
+    w = NULL;
+    gc_defrag();
+    return testPassed;
+}
+
+
+/* Linked list of integers, with compressed references */
+struct ListRef {
+   uint32_t header;
+   int n;
+   GCref next;
+};
+
+void mark_ListRef(struct GCobject **o)
+{
+    struct ListRef ** l = (struct ListRef**) o;
+    struct GCobject ** next = gc_decompress((*l)->next);
+    
+    if(next != NULL)
+    {
+        gc_mark(*next);
+    }
+}
+
+struct GCclass class_ListRef = {sizeof (struct ListRef), &mark_ListRef};
+
+int testCompressedRefs(void)
+{
+    /* a list through 32 bit references survives a compacting collection */
+    int testPassed = 1;
+    gc_defrag();
+    
+    if(gc_compress(NULL) != 0 || gc_decompress(0) != NULL)
+    {
+        testPassed = 0;
+    }
+    
+    GCref list = 0;
+    int i = 0;
+    for(; i<100; i++)
+    {
+        /* garbage in between, so that the list moves */
+        gc_malloc(&class_ListRef);
+        struct ListRef** l = (struct ListRef**) gc_malloc(&class_ListRef);
+        (*l)->n = i;
+        (*l)->next = list;
+        list = gc_compress((struct GCobject**) l);
+        if((struct ListRef**) gc_decompress(list) != l)
+        {
+            testPassed = 0;
+        }
+    }
+    
+    struct ListRef l1 = {gc_header(&class_ListRef), 1000, list};
+    struct ListRef* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    garbage_collect();
+    gc_unprotect(&root);
+    
+    if(gc_stats().count != 100)
+    {
+        testPassed = 0;
+    }
+    struct ListRef** l = (struct ListRef**) gc_decompress(list);
+    for(i = 99; l != NULL; i--)
+    {
+        if((*l)->n != i)
+        {
+            testPassed = 0;
+        }
+        l = (struct ListRef**) gc_decompress((*l)->next);
+    }
+    if(i != -1)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    return testPassed;
+}
+
+/* smaller than a header, can't be registered */
+struct GCclass class_Tiny = {2, NULL};
+
+int testHeaders(void)
+{
+    /* objects end to end, class and mark in the header */
+    int testPassed = 1;
+    gc_defrag();
+    
+    struct ListRef** l[10];
+    int i = 0;
+    for(; i<10; i++)
+    {
+        l[i] = (struct ListRef**) gc_malloc(&class_ListRef);
+        (*l[i])->next = 0;
+    }
+    if(gc_stats().used != 10*sizeof(struct ListRef)
+       || (class_ListRef.id) == 0 || CLASSOF((struct GCobject*) *l[0]) != &class_ListRef
+       || gc_header(&class_ListRef) != ((*l[0])->header))
+    {
+        testPassed = 0;
+    }
+    for(i = 1; i<10; i++)
+    {
+        if((byte*) *l[i] != (byte*) *l[i-1] + sizeof(struct ListRef))
+        {
+            testPassed = 0;
+        }
+    }
+    
+    /* marked, then unmarked by defrag, the class stays */
+    gc_mark((struct GCobject*) *l[5]);
+    if(((*l[5])->header & GC_MARKED) == 0 || ((*l[4])->header & GC_MARKED) != 0)
+    {
+        testPassed = 0;
+    }
+    gc_defrag();
+    if(gc_stats().count != 1 || (byte*) *l[5] != gc_pool 
+       || ((*l[5])->header) != gc_header(&class_ListRef))
+    {
+        testPassed = 0;
+    }
+    
+    if(gc_header(&class_Tiny) != 0 || (class_Tiny.id) != 0)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    return testPassed;
+}
+
+int testTracing(void)
+{
+    /* the phases of a collection in order, the ring keeps the last ones */
+    int testPassed = 1;
+    gc_defrag();
+    struct GCevent events[8];
+    
+    if(!gc_trace_start(8))
+    {
+        return 0;
+    }
+    gc_malloc(&class_ListInt2);
+    garbage_collect();
+    size_t n = gc_trace_read(events, 8);
+    unsigned int expected[4] = {GC_EVENT_MARK_BEGIN, GC_EVENT_MARK_END,
+                                GC_EVENT_DEFRAG_BEGIN, GC_EVENT_DEFRAG_END};
+    if(n != 4 || gc_trace_read(events, 8) != 0)
+    {
+        testPassed = 0;
+    }
+    size_t i = 0;
+    for(; testPassed && i<4; i++)
+    {
+        if((events[i].type) != expected[i] 
+           || (i > 0 && (events[i].time) < (events[i-1].time)))
+        {
+            testPassed = 0;
+        }
+    }
+    if(testPassed && ((events[1].arg) != 0 || (events[2].arg) != 1 
+                      || (events[3].arg) != sizeof(struct ListInt)))
+    {
+        testPassed = 0;
+    }
+    
+    /* 3 collections, 12 events, the last 8 are left */
+    for(i = 0; i<3; i++)
+    {
+        garbage_collect();
+    }
+    if(gc_trace_read(events, 8) != 8 || (events[0].type) != GC_EVENT_MARK_BEGIN
+       || (events[7].type) != GC_EVENT_DEFRAG_END)
+    {
+        testPassed = 0;
+    }
+    
+    /* off, nothing is recorded */
+    gc_trace_stop();
+    garbage_collect();
+    if(gc_trace_read(events, 8) != 0)
+    {
+        testPassed = 0;
+    }
+    return testPassed;
+}
+
+/* a quarter of the heap, and more than the heap */
+struct GCclass class_Quarter = {HEAPSIZE/4 - 64, NULL};
+struct GCclass class_TooLarge = {HEAPSIZE + 1, NULL};
+
+/* cache of the program, a root outside the pool */
+struct Cache {
+   uint32_t header;
+   struct GCobject** slots[4];
+};
+
+void mark_Cache(struct GCobject **o)
+{
+    struct Cache* c = (struct Cache*) (*o);
+    int i = 0;
+    for(; i<4; i++)
+    {
+        if((c->slots[i]) != NULL)
+        {
+            gc_mark(*(c->slots[i]));
+        }
+    }
+}
+
+struct GCclass class_Cache = {sizeof (struct Cache), &mark_Cache};
+struct Cache cache;
+
+/* its finalizer drops a slot of the cache */
+struct Holder {
+   uint32_t header;
+   int slot;
+};
+
+void finalize_Holder(struct GCobject *o)
+{
+    cache.slots[((struct Holder*) o)->slot] = NULL;
+}
+
+struct GCclass class_Holder = {sizeof (struct Holder), NULL, &finalize_Holder};
+
+int lowMemoryCalls = 0;
+size_t lowMemorySize = 0;
+
+int keepCache(size_t size)
+{
+    lowMemoryCalls++;
+    lowMemorySize = size;
+    return 0;
+}
+
+int dropCache(size_t size)
+{
+    lowMemoryCalls++;
+    lowMemorySize = size;
+    memset(cache.slots, 0, sizeof(cache.slots));
+    return 1;
+}
+
+/*FILL THE CACHE WITH QUARTERS FROM first*/
+void fillCache(int first)
+{
+    int i = first;
+    for(; i<4; i++)
+    {
+        cache.slots[i] = gc_malloc(&class_Quarter);
+    }
+}
+
+int testLowMemory(void)
+{
+    /* full heap: emergency collection, then the callback, then an error */
+    int testPassed = 1;
+    gc_defrag();
+    cache.header = gc_header(&class_Cache);
+    memset(cache.slots, 0, sizeof(cache.slots));
+    struct Cache* cachePtr = &cache;
+    struct GCroot root = { (struct GCobject **) &cachePtr, NULL };
+    gc_protect(&root);
+    
+    if(gc_malloc(&class_Tiny) != NULL || gc_error() != GC_ERROR_BAD_CLASS
+       || gc_malloc(&class_TooLarge) != NULL || gc_error() != GC_ERROR_TOO_LARGE)
+    {
+        testPassed = 0;
+    }
+    
+    /* the program keeps its cache */
+    fillCache(0);
+    gc_on_low_memory(&keepCache);
+    if(gc_malloc(&class_Quarter) != NULL || gc_error() != GC_ERROR_OUT_OF_MEMORY
+       || lowMemoryCalls != 1 || lowMemorySize != (class_Quarter.size))
+    {
+        testPassed = 0;
+    }
+    
+    /* the program drops it */
+    gc_on_low_memory(&dropCache);
+    if(gc_malloc(&class_Quarter) == NULL || lowMemoryCalls != 2 
+       || (cache.slots[3]) != NULL)
+    {
+        testPassed = 0;
+    }
+    
+    /* a deferred finalizer frees a slot */
+    gc_on_low_memory(NULL);
+    gc_defer_finalizers(1);
+    garbage_collect();
+    fillCache(0);
+    struct Holder** h = (struct Holder**) gc_malloc(&class_Holder);
+    (*h)->slot = 2;
+    if(gc_malloc(&class_Quarter) == NULL || (cache.slots[2]) != NULL)
+    {
+        testPassed = 0;
+    }
+    gc_defer_finalizers(0);
+    
+    /* the values of an ephemeron table, as a cache */
+    gc_oom_policy(GC_OOM_DEFAULT | GC_OOM_CLEAR_EPHEMERONS);
+    memset(cache.slots, 0, sizeof(cache.slots));
+    garbage_collect();
+    struct GCephemerons* t = gc_ephemerons_new();
+    fillCache(1);
+    cache.slots[0] = gc_malloc(&class_ListInt);
+    gc_ephemerons_put(t, cache.slots[0], gc_malloc(&class_Quarter));
+    if(gc_malloc(&class_Quarter) == NULL || gc_ephemerons_count(t) != 0)
+    {
+        testPassed = 0;
+    }
+    gc_ephemerons_free(t);
+    gc_oom_policy(GC_OOM_DEFAULT);
+    
+    gc_unprotect(&root);
+    gc_defrag();
+    return testPassed;
+}
+
+#ifdef GC_VERIFY
+/* only built in the verification mode (make BUILD=verify) */
+int testVerify(void)
+{
+    /* poisoned free space, broken heaps caught, collections on demand */
+    int testPassed = 1;
+    gc_defrag();
+    size_t size = sizeof(struct ListInt);
+    
+    gc_malloc(&class_ListInt);
+    gc_malloc(&class_ListInt);
+    struct ListInt** c = (struct ListInt**) gc_malloc(&class_ListInt);
+    gc_mark((struct GCobject*) *c);
+    gc_defrag();
+    size_t i = size;
+    for(; i<3*size; i++)
+    {
+        if(gc_pool[i] != GC_POISON)
+        {
+            testPassed = 0;
+        }
+    }
+    
+    gc_malloc(&class_ListInt);
+    if(gc_verify_heap() != NULL)
+    {
+        testPassed = 0;
+    }
+    page* first = PAGES[0];
+    PAGES[0] = PAGES[1];
+    PAGES[1] = first;
+    if(gc_verify_heap() == NULL)
+    {
+        testPassed = 0;
+    }
+    PAGES[1] = PAGES[0];
+    PAGES[0] = first;
+    uint32_t header = ((*c)->header);
+    ((*c)->header) = 0;
+    if(gc_verify_heap() == NULL)
+    {
+        testPassed = 0;
+    }
+    ((*c)->header) = header;
+    
+    /* every 2nd allocation collects */
+    unsigned long long collections = (gc_get_telemetry()->collections);
+    gc_stress_every = 2;
+    gc_set_limit();
+    for(i = 0; i<4; i++)
+    {
+        gc_malloc(&class_ListInt);
+    }
+    gc_stress_every = 0;
+    gc_set_limit();
+    if((gc_get_telemetry()->collections) != collections + 2)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    return testPassed;
+}
+#endif
+
+#if HEAPSIZE > 4294967296
+/* only built with a heap above 4 GiB (make HEAPSIZE=...) */
+struct GCclass class_Huge = {4294967296 + 16, NULL};
+
+int testLargeHeap(void)
+{
+    /* an object past 4 GiB, then moved back to the start */
+    int testPassed = 1;
+    gc_defrag();
+    
+    gc_malloc(&class_Huge);
+    struct ListInt** l = (struct ListInt**) gc_malloc(&class_ListInt2);
+    (*l)->n = 42;
+    (*l)->next = NULL;
+    
+    page* p = (page*) ((byte*) l - offsetof(page, obj));
+    if((p->left) != (class_Huge.size)
+       || gc_stats().used != (class_Huge.size) + sizeof(struct ListInt))
+    {
+        testPassed = 0;
+    }
+    
+    struct ListInt l1 = {gc_header(&class_ListInt2), 1000, l};
+    struct ListInt* l1_ptr = &l1;
+    struct GCroot root = { (struct GCobject **) &l1_ptr, NULL };
+    gc_protect(&root);
+    size_t freed = garbage_collect();
+    gc_unprotect(&root);
+    
+    if(freed != (class_Huge.size) || (p->left) != 0 || (*l)->n != 42)
+    {
+        testPassed = 0;
+    }
+    
+    gc_defrag();
+    return testPassed;
+}
+#endif
+
+
+int main(void)
+{ 
+    /* above all the locals of main, and of what got inlined in it */
+    testStackBottom = __builtin_frame_address(0);
+    
+
+    int goOn = 1;
+    if(goOn)
+    {
+        /* heap reservation, before anything is allocated */
+        if(testHeap())
+        {
+            printf("heap : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("HEAP : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* page system test */
+        if(testPages())
+        {
+            printf("pages : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("PAGES : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* assignment of values test */
+        if (test_valueAssign())
+        {
+            printf("assign : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("ASSIGN : PROBLEM\n");
+        }
+    }
+    
+    
+    if(goOn)
+    {
+        /* defrag and mark test */
+        if(test_defragging())
+        {
+            printf("defragging : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("DEFRAGGING : PROBLEM\n");
+        }
+        
+    }
+    
+    if(goOn)
+    {
+        /* object translation in memory pool test */
+        if(testTranslation())
+        {
+            printf("translation : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("TRANSLATION : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* general root system test
+         *includes protect, unprotect, marking, garbage collection
+         */
+        if(testRoot())
+        {
+            printf("root functions : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("ROOT FUNCTIONS : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* weak references cleared by the collection */
+        if(testWeak())
+        {
+            printf("weak references : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("WEAK REFERENCES : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* finalizers run in batch, or deferred */
+        if(testFinalizers())
+        {
+            printf("finalizers : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("FINALIZERS : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* ephemeron tables, traced up to the fixpoint */
+        if(testEphemerons())
+        {
+            printf("ephemerons : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("EPHEMERONS : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* roots found by scanning the stack, pinned objects */
+        if(testConservative())
+        {
+            printf("conservative : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("CONSERVATIVE : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* counters and per collection records */
+        if(testTelemetry())
+        {
+            printf("telemetry : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("TELEMETRY : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* sampled allocation sites, survival and dump */
+        if(testProfiler())
+        {
+            printf("profiler : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("PROFILER : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* heap snapshot file */
+        if(testSnapshot())
+        {
+            printf("snapshot : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("SNAPSHOT : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* 32 bit references */
+        if(testCompressedRefs())
+        {
+            printf("compressed references : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("COMPRESSED REFERENCES : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* class number and GC bits in the header */
+        if(testHeaders())
+        {
+            printf("headers : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("HEADERS : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* event log of the collector */
+        if(testTracing())
+        {
+            printf("tracing : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("TRACING : PROBLEM\n");
+        }
+    }
+    
+    if(goOn)
+    {
+        /* emergency collection and low memory callback */
+        if(testLowMemory())
+        {
+            printf("low memory : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("LOW MEMORY : PROBLEM\n");
+        }
+    }
+    
+#ifdef GC_VERIFY
+    if(goOn)
+    {
+        /* poison, heap verification and stress */
+        if(testVerify())
+        {
+            printf("verify : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("VERIFY : PROBLEM\n");
+        }
+    }
+#endif
+    
+#if HEAPSIZE > 4294967296
+    if(goOn)
+    {
+        /* offsets above 4 GiB */
+        if(testLargeHeap())
+        {
+            printf("large heap : ok\n");
+        }
+        else
+        {
+            goOn = 0;
+            printf("LARGE HEAP : PROBLEM\n");
+        }
+    }
+#endif
+    
+    
+   /* exit status 0 when everything passed */
+   return !goOn;
+}
+